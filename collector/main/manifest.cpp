@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+#include "common.h"
+#include "manifest.h"
+
+static const char *TAG = "manifest";
+
+static const char *MANIFEST_NAME = "manifest";
+static const char *MANIFEST_TMP_NAME = "manifest.tmp";
+static const uint32_t MANIFEST_MAGIC = 0x4d464e4d;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  uint32_t count;
+} manifest_header_t;
+
+// sorted by addr, then index
+static manifest_entry_t *entries = NULL;
+static uint32_t num_entries = 0;
+static uint32_t max_entries = 0;
+static bool dirty = false;
+
+// locks entries, which is read by mtftp_task and updated by write_task
+static SemaphoreHandle_t manifest_lock;
+
+static int compare(const uint8_t addr[], uint16_t index, const manifest_entry_t *entry) {
+  int ret = memcmp(addr, entry->addr, 6);
+  if (ret != 0) return ret;
+
+  return (int) index - (int) entry->index;
+}
+
+// returns the position of (addr, index) in entries, or where it would be inserted
+static uint32_t find(const uint8_t addr[], uint16_t index, bool *found) {
+  uint32_t lo = 0;
+  uint32_t hi = num_entries;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    int ret = compare(addr, index, &entries[mid]);
+
+    if (ret == 0) {
+      *found = true;
+      return mid;
+    } else if (ret < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+
+  *found = false;
+  return lo;
+}
+
+// most entries whose size in bytes fits in a uint32_t
+static const uint32_t MAX_ENTRIES = UINT32_MAX / sizeof(manifest_entry_t);
+
+static bool reserve(uint32_t count) {
+  if (count <= max_entries) return true;
+
+  if (count > MAX_ENTRIES) {
+    ESP_LOGE(TAG, "%d entries is more than the manifest can hold", count);
+    return false;
+  }
+
+  uint32_t new_max = max_entries == 0 ? 64 : max_entries;
+  while (new_max < count) new_max = new_max > MAX_ENTRIES / 2 ? MAX_ENTRIES : new_max * 2;
+
+  manifest_entry_t *new_entries = (manifest_entry_t *) realloc(entries, new_max * sizeof(manifest_entry_t));
+  if (new_entries == NULL) {
+    ESP_LOGE(TAG, "failed to allocate %d entries", new_max);
+    return false;
+  }
+
+  entries = new_entries;
+  max_entries = new_max;
+  return true;
+}
+
+static void set(const uint8_t addr[], uint16_t index, uint32_t size) {
+  bool found;
+  uint32_t pos = find(addr, index, &found);
+
+  if (found) {
+    if (entries[pos].size == size) return;
+  } else {
+    if (!reserve(num_entries + 1)) return;
+
+    memmove(&entries[pos + 1], &entries[pos], (num_entries - pos) * sizeof(manifest_entry_t));
+    memcpy(entries[pos].addr, addr, 6);
+    entries[pos].index = index;
+    num_entries ++;
+  }
+
+  entries[pos].size = size;
+  dirty = true;
+}
+
+static bool load(const char *name) {
+  char fname[LEN_MAX_FNAME];
+  snprintf(fname, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, name);
+
+  FILE *fp = fopen(fname, "r");
+  if (fp == NULL) return false;
+
+  manifest_header_t header;
+  bool ok = fread(&header, sizeof(manifest_header_t), 1, fp) == 1 && header.magic == MANIFEST_MAGIC;
+
+  // the count has to match the length of the file before anything is allocated for it
+  long len = -1;
+  if (ok && fseek(fp, 0, SEEK_END) == 0) len = ftell(fp);
+  ok = ok && len >= 0 && (uint64_t) len == sizeof(manifest_header_t) + (uint64_t) header.count * sizeof(manifest_entry_t);
+  ok = ok && fseek(fp, sizeof(manifest_header_t), SEEK_SET) == 0;
+
+  if (ok && reserve(header.count)) {
+    ok = fread(entries, sizeof(manifest_entry_t), header.count, fp) == header.count;
+    num_entries = ok ? header.count : 0;
+  } else {
+    ok = false;
+  }
+
+  fclose(fp);
+
+  if (!ok) ESP_LOGW(TAG, "%s is corrupt", fname);
+
+  return ok;
+}
+
+// adds every file in the bucket directories under node_path to the manifest
+static void rebuild_node(const char *node_path, const uint8_t addr[]) {
+  DIR *d = opendir(node_path);
+  if (d == NULL) return;
+
+  struct dirent *dir;
+  char bucket_path[LEN_MAX_FNAME];
+  char fname[LEN_MAX_FNAME];
+
+  while ((dir = readdir(d)) != NULL) {
+    if (dir->d_type != DT_DIR || dir->d_name[0] != 'B') continue;
+
+    snprintf(bucket_path, LEN_MAX_FNAME, "%s/%s", node_path, dir->d_name);
+
+    DIR *bucket = opendir(bucket_path);
+    if (bucket == NULL) continue;
+
+    struct dirent *file;
+    while ((file = readdir(bucket)) != NULL) {
+      if (file->d_type != DT_REG) continue;
+
+      uint16_t index;
+      if (!conv_strtoul(file->d_name, &index) || index == 0) continue;
+
+      snprintf(fname, LEN_MAX_FNAME, "%s/%s", bucket_path, file->d_name);
+
+      struct stat st;
+      if (stat(fname, &st) != 0) continue;
+
+      set(addr, index, st.st_size);
+    }
+
+    closedir(bucket);
+  }
+
+  closedir(d);
+}
+
+// builds the manifest from the node directories (named by MAC) on the SD card
+static void rebuild(void) {
+  DIR *d = opendir(SD_MOUNT_POINT);
+
+  if (d == NULL) {
+    ESP_LOGW(TAG, "failed to open %s", SD_MOUNT_POINT);
+    return;
+  }
+
+  struct dirent *dir;
+  char node_path[LEN_MAX_FNAME];
+
+  while ((dir = readdir(d)) != NULL) {
+    if (dir->d_type != DT_DIR) continue;
+
+    unsigned int mac[6];
+    char end;
+
+    if (sscanf(dir->d_name, "%02X%02X%02X%02X%02X%02X%c", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &end) != 6) continue;
+
+    uint8_t addr[6];
+    for (uint8_t i = 0; i < 6; i++) addr[i] = mac[i];
+
+    snprintf(node_path, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, dir->d_name);
+    rebuild_node(node_path, addr);
+  }
+
+  closedir(d);
+}
+
+void manifest_init(void) {
+  manifest_lock = xSemaphoreCreateMutex();
+  assert(manifest_lock != NULL);
+
+  // the temporary file is only left behind if power was lost between removing the
+  // old manifest and renaming the new one
+  if (!load(MANIFEST_NAME) && !load(MANIFEST_TMP_NAME)) {
+    ESP_LOGI(TAG, "no manifest, rebuilding from files");
+    num_entries = 0;
+    rebuild();
+    manifest_save();
+  }
+
+  ESP_LOGI(TAG, "%d files in manifest", num_entries);
+}
+
+bool manifest_get(const uint8_t addr[], uint16_t index, uint32_t *size) {
+  xSemaphoreTake(manifest_lock, portMAX_DELAY);
+
+  bool found;
+  uint32_t pos = find(addr, index, &found);
+  if (found) *size = entries[pos].size;
+
+  xSemaphoreGive(manifest_lock);
+
+  return found;
+}
+
+void manifest_set(const uint8_t addr[], uint16_t index, uint32_t size) {
+  xSemaphoreTake(manifest_lock, portMAX_DELAY);
+  set(addr, index, size);
+  xSemaphoreGive(manifest_lock);
+}
+
+bool manifest_save(void) {
+  char fname[LEN_MAX_FNAME];
+  char tmp_fname[LEN_MAX_FNAME];
+  snprintf(fname, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, MANIFEST_NAME);
+  snprintf(tmp_fname, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, MANIFEST_TMP_NAME);
+
+  xSemaphoreTake(manifest_lock, portMAX_DELAY);
+
+  if (!dirty) {
+    xSemaphoreGive(manifest_lock);
+    return true;
+  }
+
+  // written to a temporary file first so a power loss leaves either the old or new manifest
+  FILE *fp = fopen(tmp_fname, "w");
+  if (fp == NULL) {
+    ESP_LOGE(TAG, "fopen %s failed", tmp_fname);
+    xSemaphoreGive(manifest_lock);
+    return false;
+  }
+
+  manifest_header_t header = { MANIFEST_MAGIC, num_entries };
+  bool ok = fwrite(&header, sizeof(manifest_header_t), 1, fp) == 1;
+  ok = ok && fwrite(entries, sizeof(manifest_entry_t), num_entries, fp) == num_entries;
+  fclose(fp);
+
+  if (ok) {
+    // FATFS rename fails if the destination exists
+    remove(fname);
+    ok = rename(tmp_fname, fname) == 0;
+  }
+
+  if (ok) {
+    dirty = false;
+  } else {
+    ESP_LOGE(TAG, "failed to save manifest");
+  }
+
+  xSemaphoreGive(manifest_lock);
+
+  return ok;
+}
@@ -0,0 +1,23 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+
+// number of bytes of a node's file that have been downloaded
+typedef struct __attribute__((__packed__)) {
+  uint8_t addr[6];
+  uint16_t index;
+  uint32_t size;
+} manifest_entry_t;
+
+// loads the manifest from the SD card, or rebuilds it from the downloaded files if there is none
+void manifest_init(void);
+
+// returns false if nothing of the file has been downloaded
+bool manifest_get(const uint8_t addr[], uint16_t index, uint32_t *size);
+void manifest_set(const uint8_t addr[], uint16_t index, uint32_t size);
+
+// writes the manifest to the SD card if it changed since it was last saved
+bool manifest_save(void);
+
+#endif
@@ -12,6 +12,8 @@
 
 #include "mtftp_task.h"
 #include "write_task.h"
+#include "manifest.h"
+#include "psram_stage.h"
 #include "common.h"
 
 // interval in ms
@@ -26,15 +28,57 @@ enum state {
   STATE_ACTIVE        // transfer in progress
 };
 
+// entry in file_entries
+typedef struct {
+  uint16_t index;
+  // offset to start reading from
+  uint32_t offset;
+  // size of the file on the node
+  uint32_t size;
+} read_entry_t;
+
+// entry in peer_queue
+typedef struct {
+  uint8_t addr[6];
+  // true if the node sent a sync_summary_t with its SYNC reply
+  bool has_summary;
+  sync_summary_t summary;
+} peer_entry_t;
+
+// summary of a node as of the last time all its files were downloaded
+typedef struct {
+  uint8_t addr[6];
+  sync_summary_t summary;
+} peer_cache_entry_t;
+
 struct {
   uint8_t peer_addr[6];
   enum state state;
 
+  // summary sent by the current peer, saved to peer_cache once everything is downloaded
+  bool peer_has_summary;
+  sync_summary_t peer_summary;
+  // peer the summary was sent by, kept after peer_addr is cleared
+  uint8_t summary_addr[6];
+  // set if the file list had more entries than file_entries could hold
+  bool file_list_truncated;
+  // file being read and its size on the node
+  uint16_t read_index;
+  uint32_t read_size;
+  // set when a peer is started, cleared if anything it sent could not be stored or it
+  // timed out. peer_cache is only updated if it is still set once the files are written out
+  bool session_complete;
+  // write_error_count when the peer was started
+  uint32_t session_write_errors;
+
+  peer_cache_entry_t peer_cache[CONFIG_LEN_PEER_CACHE];
+  uint8_t peer_cache_next;
+
   uint32_t bytes_rx;
 
-  // stores list of file_list_entry_t
+  // stores list of read_entry_t
   QueueHandle_t file_entries;
-  // stores MAC addresses of peers that respond
+  // stores peer_entry_t of peers that respond
   QueueHandle_t peer_queue;
 } local_state;
 
@@ -54,18 +98,22 @@ static bool writeFile(uint16_t file_index, uint32_t file_offset, const uint8_t *
     // clear the ringbuffer
     if (file_offset == 0) {
       xQueueReset(local_state.file_entries);
+      local_state.file_list_truncated = false;
     } else {
       ESP_LOGW(TAG, "handling of file_index=0 at offset %d is likely broken!", file_offset);
     }
 
     file_list_entry_t *entry;
+    read_entry_t read_entry;
     for (uint16_t i = 0; (i + 1) * sizeof(file_list_entry_t) <= btw; i++) {
       entry = (file_list_entry_t *) (data + (i * sizeof(file_list_entry_t)));
+      read_entry.index = entry->index;
+      read_entry.size = entry->size;
 
       #ifndef CONFIG_ALWAYS_DOWNLOAD
         uint32_t local_size;
         // if file exists, save the entry only if local_size < remote size
-        if (get_file_size(local_state.peer_addr, entry->index, &local_size)) {
+        if (manifest_get(local_state.peer_addr, entry->index, &local_size)) {
           if (local_size > entry->size) {
             ESP_LOGW(TAG, "local size (%d) of file_index=%d more than remote size (%d)", local_size, entry->index, entry->size);
             continue;
@@ -73,23 +121,20 @@ static bool writeFile(uint16_t file_index, uint32_t file_offset, const uint8_t *
             continue;
           }
 
-          if (local_size == 0) {
-            entry->size = 0;
-          } else {
-            entry->size = local_size;
-          }
+          read_entry.offset = local_size;
         } else {
-          entry->size = 0;
+          read_entry.offset = 0;
         }
       #else
         ESP_LOGI(TAG, "queuing read because ALWAYS_DOWNLOAD is set");
-        entry->size = 0;
+        read_entry.offset = 0;
       #endif
 
-      if (xQueueSend(local_state.file_entries, entry, 0) == pdTRUE) {
-        ESP_LOGI(TAG, "queuing read of file_index=%d at offset=%d", entry->index, entry->size);
+      if (xQueueSend(local_state.file_entries, &read_entry, 0) == pdTRUE) {
+        ESP_LOGI(TAG, "queuing read of file_index=%d at offset=%d", read_entry.index, read_entry.offset);
       } else {
         // no more space in queue, no point parsing further
+        local_state.file_list_truncated = true;
         break;
       }
     }
@@ -97,14 +142,69 @@ static bool writeFile(uint16_t file_index, uint32_t file_offset, const uint8_t *
     return true;
   }
 
-  return write_sd(local_state.peer_addr, file_index, file_offset, data, btw);
+  uint32_t file_size = file_index == local_state.read_index ? local_state.read_size : 0;
+
+  #ifdef CONFIG_PSRAM_STAGING
+    // never waits for the SD card, a block that does not fit is sent again
+    bool ok = psram_stage_write(local_state.peer_addr, file_index, file_size, file_offset, data, btw);
+  #else
+    bool ok = write_sd(local_state.peer_addr, file_index, file_size, file_offset, data, btw);
+  #endif
+
+  if (!ok) local_state.session_complete = false;
+  return ok;
+}
+
+static peer_cache_entry_t *findPeerCache(const uint8_t *addr) {
+  for (uint8_t i = 0; i < CONFIG_LEN_PEER_CACHE; i++) {
+    if (memcmp(local_state.peer_cache[i].addr, addr, 6) == 0) {
+      return &local_state.peer_cache[i];
+    }
+  }
+
+  return NULL;
+}
+
+// records the summary of the last peer if all its files have been downloaded and written out
+static void updatePeerCache(void) {
+  if (write_error_count() != local_state.session_write_errors) local_state.session_complete = false;
+
+  bool complete = local_state.session_complete;
+  local_state.session_complete = false;
+
+  if (!complete || !local_state.peer_has_summary || local_state.file_list_truncated) return;
+
+  peer_cache_entry_t *cache = findPeerCache(local_state.summary_addr);
+
+  if (cache == NULL) {
+    // replace the oldest entry
+    cache = &local_state.peer_cache[local_state.peer_cache_next];
+    local_state.peer_cache_next = (local_state.peer_cache_next + 1) % CONFIG_LEN_PEER_CACHE;
+    memcpy(cache->addr, local_state.summary_addr, 6);
+  }
+
+  cache->summary = local_state.peer_summary;
+}
+
+// returns true if peer has nothing new since all its files were last downloaded
+static bool isPeerUpToDate(const peer_entry_t *peer) {
+  #ifdef CONFIG_ALWAYS_DOWNLOAD
+    return false;
+  #else
+    if (!peer->has_summary) return false;
+
+    peer_cache_entry_t *cache = findPeerCache(peer->addr);
+    if (cache == NULL) return false;
+
+    return memcmp(&cache->summary, &peer->summary, sizeof(sync_summary_t)) == 0;
+  #endif
 }
 
 static void onRecvEspNowCb(const uint8_t *mac_addr, const uint8_t *data, int len) {
   const char *TAG = "onRecvEspNowCb";
   ESP_LOGV(TAG, "received packet from " FORMAT_MAC ", len=%d, data[0]=%02x", ARG_MAC(mac_addr), len, (unsigned int) data[0]);
 
-  if (len == LEN_SYNC_PACKET && memcmp(data, SYNC_PACKET, LEN_SYNC_PACKET) == 0) {
+  if ((len == LEN_SYNC_PACKET || len == LEN_SYNC_SUMMARY_PACKET) && memcmp(data, SYNC_PACKET, LEN_SYNC_PACKET) == 0) {
     if (memcmp(mac_addr, local_state.peer_addr, 6) == 0) {
       // already communicating with peer, ignore sync
       // side effect of sending another sync packet to a node to reactivate it
@@ -113,7 +213,14 @@ static void onRecvEspNowCb(const uint8_t *mac_addr, const uint8_t *data, int len
 
     ESP_LOGI(TAG, "sync packet received from " FORMAT_MAC, ARG_MAC(mac_addr));
 
-    if (xQueueSend(local_state.peer_queue, mac_addr, 0) == pdFALSE) {
+    peer_entry_t peer;
+    memcpy(peer.addr, mac_addr, 6);
+    peer.has_summary = (len == LEN_SYNC_SUMMARY_PACKET);
+    if (peer.has_summary) {
+      memcpy(&peer.summary, data + LEN_SYNC_PACKET, sizeof(sync_summary_t));
+    }
+
+    if (xQueueSend(local_state.peer_queue, &peer, 0) == pdFALSE) {
       ESP_LOGW(TAG, "peer_queue full. Perhaps increase CONFIG_LEN_PEER_QUEUE?");
     }
   } else {
@@ -131,12 +238,27 @@ static void onRecvEspNowCb(const uint8_t *mac_addr, const uint8_t *data, int len
 // returns true if communication with a peer has been started, or false otherwise
 static bool startPeered(void) {
   const char *TAG = "startPeered";
-  uint8_t mac_addr[6];
+  peer_entry_t peer;
 
-  if (xQueueReceive(local_state.peer_queue, mac_addr, 0) == pdFALSE) {
+  if (xQueueReceive(local_state.peer_queue, &peer, 0) == pdFALSE) {
     return false;
   }
 
+  uint8_t *mac_addr = peer.addr;
+
+  if (isPeerUpToDate(&peer)) {
+    ESP_LOGI(TAG, "skipping " FORMAT_MAC ", nothing new since last sync (generation=%d)", ARG_MAC(mac_addr), peer.summary.generation);
+    return false;
+  }
+
+  local_state.peer_has_summary = peer.has_summary;
+  local_state.peer_summary = peer.summary;
+  memcpy(local_state.summary_addr, mac_addr, 6);
+
+  local_state.session_complete = true;
+  local_state.session_write_errors = write_error_count();
+  local_state.read_index = 0;
+
   espnow_add_peer(mac_addr);
   memcpy(local_state.peer_addr, mac_addr, 6);
 
@@ -153,6 +275,7 @@ static bool startPeered(void) {
 }
 
 // end communication with a peer, either upon timeout or no more file entries
+// its files are still being written out, updatePeerCache runs once they are
 static void endPeered(void) {
   const char *TAG = "endPeered";
 
@@ -162,34 +285,65 @@ static void endPeered(void) {
   memset(local_state.peer_addr, 0, 6);
   local_state.state = STATE_FIND_PEER;
 
-  wait_for_close();
+  // with PSRAM staging only psram_drain_task writes to the file, and closes it when drained
+  #ifndef CONFIG_PSRAM_STAGING
+    wait_for_close();
+    manifest_save();
+  #endif
+}
+
+static void onTimeout(void) {
+  local_state.session_complete = false;
+  endPeered();
 }
 
+// the file is not closed here, so whatever is still waiting to be written out when the
+// next read starts is counted by nextWindowSize. write_sd closes it once the next file
+// starts arriving, and endPeered once the peer is done
 static void transferEnd(void) {
-  wait_for_close();
   local_state.state = STATE_START_READ;
 }
 
-static void clear_files(void) {
-  const char *TAG = "clear_files";
+// window for the next read, scaled down by the data from earlier reads still waiting to be written out
+static uint16_t nextWindowSize(void) {
+  #ifdef CONFIG_PSRAM_STAGING
+    return psram_stage_window_size(CONFIG_WINDOW_SIZE);
+  #else
+    return write_window_size(CONFIG_WINDOW_SIZE);
+  #endif
+}
 
-  ESP_LOGW(TAG, "clearing all files in root directory of SD card!");
+// removes all files under path, and the directories below it if remove_dirs is set
+static void remove_dir_contents(const char *path, bool remove_dirs) {
+  const char *TAG = "clear_files";
 
-  DIR *d = opendir(SD_MOUNT_POINT);
+  DIR *d = opendir(path);
 
   if (d == NULL) {
-    ESP_LOGW(TAG, "failed to open %s", SD_MOUNT_POINT);
+    ESP_LOGW(TAG, "failed to open %s", path);
+    return;
   }
 
   struct dirent *dir;
   char fname[LEN_MAX_FNAME];
 
   while ((dir = readdir(d)) != NULL) {
-    if (dir->d_type != DT_REG) continue;
+    if (dir->d_type != DT_REG && dir->d_type != DT_DIR) continue;
 
-    if (snprintf(fname, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, dir->d_name) == LEN_MAX_FNAME) {
-      printf("possible truncation");
-    };
+    if (snprintf(fname, LEN_MAX_FNAME, "%s/%s", path, dir->d_name) >= LEN_MAX_FNAME) {
+      ESP_LOGW(TAG, "skipping %s/%s, name too long", path, dir->d_name);
+      continue;
+    }
+
+    if (dir->d_type == DT_DIR) {
+      if (!remove_dirs) continue;
+
+      remove_dir_contents(fname, true);
+      if (rmdir(fname) != 0) {
+        ESP_LOGW(TAG, "failed to remove %s", fname);
+      }
+      continue;
+    }
 
     if (remove(fname) == 0) {
       ESP_LOGI(TAG, "removed %s", fname);
@@ -201,6 +355,51 @@ static void clear_files(void) {
   closedir(d);
 }
 
+static void clear_files(void) {
+  const char *TAG = "clear_files";
+
+  ESP_LOGW(TAG, "clearing all files on SD card!");
+
+  remove_dir_contents(SD_MOUNT_POINT, true);
+}
+
+// moves files written before the sharded layout (MAC-index in the root of the SD card)
+// into the directory of their node
+static void migrate_files(void) {
+  const char *TAG = "migrate_files";
+
+  DIR *d = opendir(SD_MOUNT_POINT);
+  if (d == NULL) return;
+
+  struct dirent *dir;
+  char old_fname[LEN_MAX_FNAME];
+  char new_fname[LEN_MAX_FNAME];
+
+  while ((dir = readdir(d)) != NULL) {
+    if (dir->d_type != DT_REG) continue;
+
+    unsigned int mac[6];
+    unsigned int index;
+    char end;
+
+    if (sscanf(dir->d_name, "%02X%02X%02X%02X%02X%02X-%u%c", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &index, &end) != 7) continue;
+
+    uint8_t addr[6];
+    for (uint8_t i = 0; i < 6; i++) addr[i] = mac[i];
+
+    snprintf(old_fname, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, dir->d_name);
+    get_addr_id_path(addr, index, new_fname);
+
+    if (make_parent_dirs(new_fname) && rename(old_fname, new_fname) == 0) {
+      ESP_LOGI(TAG, "moved %s to %s", old_fname, new_fname);
+    } else {
+      ESP_LOGW(TAG, "failed to move %s to %s", old_fname, new_fname);
+    }
+  }
+
+  closedir(d);
+}
+
 static void rate_logging_task(void *pvParameter) {
   const char *TAG = "transfer";
 
@@ -251,25 +450,36 @@ static void led_task(void *pvParameter) {
 void mtftp_task(void *pvParameter) {
   const char *TAG = "mtftp_task";
 
+  write_init();
   xTaskCreate(write_task, "write_task", 2048, NULL, 5, NULL);
 
   memset(&local_state, 0, sizeof(local_state));
-  local_state.file_entries = xQueueCreate(CONFIG_LEN_FILE_LIST, sizeof(file_list_entry_t));
-  local_state.peer_queue = xQueueCreate(CONFIG_LEN_PEER_QUEUE, 6);
+  local_state.file_entries = xQueueCreate(CONFIG_LEN_FILE_LIST, sizeof(read_entry_t));
+  local_state.peer_queue = xQueueCreate(CONFIG_LEN_PEER_QUEUE, sizeof(peer_entry_t));
 
   assert(local_state.file_entries != NULL);
+  assert(local_state.peer_queue != NULL);
 
   if (get_btn_user() == 0) {
     clear_files();
   }
 
+  migrate_files();
+
+  manifest_init();
+  write_recover();
+
+  #ifdef CONFIG_PSRAM_STAGING
+    if (!psram_stage_init()) abort();
+  #endif
+
   setEspNowTxAddr(local_state.peer_addr);
   esp_now_register_recv_cb(onRecvEspNowCb);
 
   espnow_add_peer(MAC_BROADCAST);
 
   client.init(&writeFile, &sendEspNow);
-  client.setOnTimeoutCb(&endPeered);
+  client.setOnTimeoutCb(&onTimeout);
   client.setOnTransferEndCb(&transferEnd);
 
   xTaskCreate(client_loop_task, "client_loop_task", 4096, NULL, 5, NULL);
@@ -278,6 +488,17 @@ void mtftp_task(void *pvParameter) {
 
   while(1) {
     if (local_state.state == STATE_FIND_PEER) {
+      #ifdef CONFIG_PSRAM_STAGING
+        // write out what was received from the last peer before looking for the next one
+        if (!psram_stage_empty()) {
+          psram_stage_drain();
+          manifest_save();
+        }
+      #endif
+
+      // everything from the last peer is on the card now
+      updatePeerCache();
+
       if (!startPeered()) {
         vTaskDelay(pdMS_TO_TICKS(500));
         esp_now_send(MAC_BROADCAST, SYNC_PACKET, LEN_SYNC_PACKET);
@@ -287,10 +508,15 @@ void mtftp_task(void *pvParameter) {
       }
     } else if (local_state.state == STATE_START_READ) {
       // if files are available in file_entries, start reading the next one
-      file_list_entry_t entry;
+      read_entry_t entry;
 
       if (xQueueReceive(local_state.file_entries, &entry, 0) == pdTRUE) {
-        client.beginRead(entry.index, entry.size, CONFIG_WINDOW_SIZE);
+        local_state.read_index = entry.index;
+        local_state.read_size = entry.size;
+        uint16_t window_size = nextWindowSize();
+        if (window_size < CONFIG_WINDOW_SIZE) ESP_LOGI(TAG, "write backlog, reading with window_size=%d", window_size);
+
+        client.beginRead(entry.index, entry.offset, window_size);
         local_state.state = STATE_ACTIVE;
       } else {
         ESP_LOGI(TAG, "no more files queued");
@@ -0,0 +1,326 @@
+#include <string.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#include "common.h"
+#include "staging_buf.h"
+#include "write_task.h"
+#include "psram_stage.h"
+
+#ifdef CONFIG_PSRAM_STAGING
+
+static const char *TAG = "psram_stage";
+
+// header in front of each run of contiguous data in the arena
+typedef struct __attribute__((__packed__)) {
+  uint8_t addr[6];
+  uint16_t file_index;
+  // size of the file on the node, for write_sd to preallocate it
+  uint32_t file_size;
+  uint32_t file_offset;
+  uint32_t len;
+} segment_t;
+
+// the arena is split into two halves. blocks are appended to one while psram_drain_task
+// writes the other out to the SD card
+typedef struct {
+  uint8_t *buf;
+  uint32_t used;
+  // last segment in the half, extended while blocks arrive in order
+  segment_t *last_segment;
+  // set from when the half is handed to psram_drain_task until it has been written out
+  volatile bool draining;
+} arena_t;
+
+typedef struct {
+  uint8_t arena;
+  // close the file and give drain_done once the half has been written out
+  bool close;
+} drain_req_t;
+
+static arena_t arenas[2];
+// size of each half
+static uint32_t arena_size = 0;
+// half that blocks are appended to
+static uint8_t cur_arena = 0;
+// set once a block has been stored since the last psram_stage_drain. halves drained in the
+// background leave the file open, so the arena is only empty once it has been drained
+static bool pending = false;
+
+static QueueHandle_t drain_queue;
+static SemaphoreHandle_t drain_done;
+
+// ranges received of the file blocks are currently arriving for. write_sd has to place every
+// accepted block, so a block is only accepted if it is within staging of the contiguous data
+// and does not open more gaps than staging can hold
+static struct {
+  bool valid;
+  uint8_t addr[6];
+  uint16_t file_index;
+  // everything before this has been received
+  uint32_t contig_end;
+  // ranges received after gaps, sorted and not touching each other or contig_end
+  staging_extent_t ahead[STAGING_MAX_EXTENTS];
+  uint8_t num_ahead;
+} track;
+
+static uint32_t align4(uint32_t n) {
+  return (n + 3) & ~3;
+}
+
+// adds [start, end) to track.ahead, merging it with any ranges it touches
+static bool track_add_ahead(uint32_t start, uint32_t end) {
+  uint8_t i = 0;
+  while (i < track.num_ahead && track.ahead[i].end < start) i++;
+
+  uint8_t j = i;
+  while (j < track.num_ahead && track.ahead[j].start <= end) j++;
+
+  if (i == j) {
+    if (track.num_ahead == STAGING_MAX_EXTENTS) return false;
+
+    memmove(&track.ahead[i + 1], &track.ahead[i], (track.num_ahead - i) * sizeof(staging_extent_t));
+    track.num_ahead ++;
+  } else {
+    if (track.ahead[i].start < start) start = track.ahead[i].start;
+    if (track.ahead[j - 1].end > end) end = track.ahead[j - 1].end;
+
+    memmove(&track.ahead[i + 1], &track.ahead[j], (track.num_ahead - j) * sizeof(staging_extent_t));
+    track.num_ahead -= j - i - 1;
+  }
+
+  track.ahead[i].start = start;
+  track.ahead[i].end = end;
+  return true;
+}
+
+// returns false, without recording it, if write_sd could not place [start, end) of file_index
+static bool track_block(const uint8_t addr[], uint16_t file_index, uint32_t start, uint32_t end) {
+  if (!track.valid || track.file_index != file_index || memcmp(track.addr, addr, 6) != 0) {
+    track.valid = true;
+    memcpy(track.addr, addr, 6);
+    track.file_index = file_index;
+    track.contig_end = start;
+    track.num_ahead = 0;
+  }
+
+  if (start <= track.contig_end) {
+    if (end > track.contig_end) track.contig_end = end;
+  } else {
+    // write_task only writes out whole regions, so the region before the gap can still be in staging
+    if (end - track.contig_end > write_staging_size() - write_region_size()) return false;
+    if (!track_add_ahead(start, end)) return false;
+  }
+
+  // ranges that the block has joined up with
+  while (track.num_ahead > 0 && track.ahead[0].start <= track.contig_end) {
+    if (track.ahead[0].end > track.contig_end) track.contig_end = track.ahead[0].end;
+
+    track.num_ahead --;
+    memmove(&track.ahead[0], &track.ahead[1], track.num_ahead * sizeof(staging_extent_t));
+  }
+
+  return true;
+}
+
+static int compare_segments(const void *a, const void *b) {
+  const segment_t *sa = *(const segment_t **) a;
+  const segment_t *sb = *(const segment_t **) b;
+
+  int ret = memcmp(sa->addr, sb->addr, 6);
+  if (ret != 0) return ret;
+  if (sa->file_index != sb->file_index) return sa->file_index < sb->file_index ? -1 : 1;
+  if (sa->file_offset != sb->file_offset) return sa->file_offset < sb->file_offset ? -1 : 1;
+  return 0;
+}
+
+static void write_segment(const segment_t *segment) {
+  const uint8_t *data = (const uint8_t *) segment + sizeof(segment_t);
+
+  // hand over at most one region at a time so each call fits in write_task's staging
+  for (uint32_t done = 0; done < segment->len; ) {
+    uint32_t btw = segment->len - done;
+    if (btw > write_region_size()) btw = write_region_size();
+
+    if (!write_sd((uint8_t *) segment->addr, segment->file_index, segment->file_size, segment->file_offset + done, data + done, btw)) {
+      ESP_LOGE(TAG, "failed to write %d bytes of file_index=%d at offset=%d", btw, segment->file_index, segment->file_offset + done);
+      return;
+    }
+
+    done += btw;
+  }
+}
+
+// writes out the segments of a half in file and offset order, so blocks that arrived out of
+// order reach staging in order and the gaps before them are already filled
+static void drain_arena(arena_t *arena) {
+  ESP_LOGI(TAG, "draining %d bytes to SD", arena->used);
+
+  uint32_t num_segments = 0;
+  for (uint32_t pos = 0; pos < arena->used; ) {
+    segment_t *segment = (segment_t *) (arena->buf + pos);
+    num_segments ++;
+    pos = align4(pos + sizeof(segment_t) + segment->len);
+  }
+
+  segment_t **segments = (segment_t **) malloc(num_segments * sizeof(segment_t *));
+
+  if (segments == NULL) {
+    ESP_LOGW(TAG, "failed to allocate %d segments, draining in arrival order", num_segments);
+
+    for (uint32_t pos = 0; pos < arena->used; ) {
+      segment_t *segment = (segment_t *) (arena->buf + pos);
+      write_segment(segment);
+      pos = align4(pos + sizeof(segment_t) + segment->len);
+    }
+  } else {
+    uint32_t i = 0;
+    for (uint32_t pos = 0; pos < arena->used; i++) {
+      segments[i] = (segment_t *) (arena->buf + pos);
+      pos = align4(pos + sizeof(segment_t) + segments[i]->len);
+    }
+
+    qsort(segments, num_segments, sizeof(segment_t *), compare_segments);
+
+    for (i = 0; i < num_segments; i++) {
+      write_segment(segments[i]);
+    }
+
+    free(segments);
+  }
+
+  arena->used = 0;
+  arena->last_segment = NULL;
+}
+
+static void psram_drain_task(void *pvParameter) {
+  while(1) {
+    drain_req_t req;
+    xQueueReceive(drain_queue, &req, portMAX_DELAY);
+
+    arena_t *arena = &arenas[req.arena];
+    if (arena->used > 0) drain_arena(arena);
+
+    // the file stays open between halves, so a gap can be filled by a block in the next one
+    if (req.close) wait_for_close();
+
+    arena->draining = false;
+    if (req.close) xSemaphoreGive(drain_done);
+  }
+}
+
+// hands the current half to psram_drain_task and continues in the other one
+static void hand_over(bool close) {
+  drain_req_t req = {cur_arena, close};
+
+  arenas[cur_arena].draining = true;
+  // each half is queued at most once at a time, so this never blocks
+  xQueueSend(drain_queue, &req, portMAX_DELAY);
+  cur_arena = !cur_arena;
+}
+
+bool psram_stage_init(void) {
+  arena_size = align4(CONFIG_PSRAM_STAGING_SIZE * 1024 / 2);
+  uint8_t *buf = (uint8_t *) heap_caps_malloc(arena_size * 2, MALLOC_CAP_SPIRAM);
+
+  if (buf == NULL) {
+    ESP_LOGE(TAG, "failed to allocate %d bytes", arena_size * 2);
+    return false;
+  }
+
+  for (uint8_t i = 0; i < 2; i++) {
+    arenas[i].buf = buf + i * arena_size;
+    arenas[i].used = 0;
+    arenas[i].last_segment = NULL;
+    arenas[i].draining = false;
+  }
+
+  drain_queue = xQueueCreate(2, sizeof(drain_req_t));
+  drain_done = xSemaphoreCreateBinary();
+  xTaskCreate(psram_drain_task, "psram_drain_task", 4096, NULL, 5, NULL);
+
+  ESP_LOGI(TAG, "staging up to %d bytes in PSRAM", arena_size * 2);
+  return true;
+}
+
+bool psram_stage_write(const uint8_t addr[], uint16_t file_index, uint32_t file_size, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+  arena_t *arena = &arenas[cur_arena];
+
+  // the current half can still be draining after psram_stage_drain
+  if (arena->draining) return false;
+
+  segment_t *last = arena->last_segment;
+  bool extend = last != NULL && last->file_index == file_index &&
+    memcmp(last->addr, addr, 6) == 0 && last->file_offset + last->len == file_offset;
+
+  uint32_t end = extend ? arena->used + btw : align4(arena->used) + sizeof(segment_t) + btw;
+
+  if (end > arena_size) {
+    // the other half is still being written out, so the SD card is behind. the block is
+    // not acked and is sent again by the node
+    if (arenas[!cur_arena].draining) return false;
+
+    hand_over(false);
+    arena = &arenas[cur_arena];
+    extend = false;
+  }
+
+  if (!track_block(addr, file_index, file_offset, file_offset + btw)) {
+    ESP_LOGD(TAG, "block at %d too far past a gap, dropping", file_offset);
+    return false;
+  }
+
+  pending = true;
+
+  if (extend) {
+    memcpy(arena->buf + arena->used, data, btw);
+    arena->used += btw;
+    arena->last_segment->len += btw;
+    return true;
+  }
+
+  uint32_t start = align4(arena->used);
+
+  segment_t *segment = (segment_t *) (arena->buf + start);
+  memcpy(segment->addr, addr, 6);
+  segment->file_index = file_index;
+  segment->file_size = file_size;
+  segment->file_offset = file_offset;
+  segment->len = btw;
+
+  memcpy(arena->buf + start + sizeof(segment_t), data, btw);
+  arena->used = start + sizeof(segment_t) + btw;
+  arena->last_segment = segment;
+
+  return true;
+}
+
+bool psram_stage_empty(void) {
+  return !pending;
+}
+
+uint16_t psram_stage_window_size(uint16_t window_size) {
+  // same as write_window_size. a half that is still draining has no space yet
+  uint32_t free = arena_size - arenas[cur_arena].used;
+  if (!arenas[!cur_arena].draining) free += arena_size - arenas[!cur_arena].used;
+
+  uint16_t scaled = (uint64_t) window_size * free / (arena_size * 2);
+
+  if (scaled == 0) return 1;
+  return scaled;
+}
+
+void psram_stage_drain(void) {
+  hand_over(true);
+  xSemaphoreTake(drain_done, portMAX_DELAY);
+
+  track.valid = false;
+  pending = false;
+}
+
+#endif
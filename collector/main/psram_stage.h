@@ -0,0 +1,30 @@
+#ifndef PSRAM_STAGE_H
+#define PSRAM_STAGE_H
+
+#include <stdint.h>
+
+/*
+  arena in PSRAM that received blocks are appended to during a transfer
+
+  the arena is split into two halves. once one is full, psram_drain_task writes
+  it to the SD card through write_sd while blocks are appended to the other, so
+  the receive path never waits for the card. the rest is drained between peers
+
+  nothing in the arena is recorded in the manifest until it has been drained,
+  so data lost to a reset is downloaded again
+*/
+
+// allocates the arena and starts psram_drain_task, call after write_init
+bool psram_stage_init(void);
+// returns false if the block cannot be stored, it is then not acked and sent again:
+// both halves are full, or the block is further past a gap than write_sd could place it
+// file_size is passed on to write_sd with the block, as the file may only be opened
+// once the next read has started
+bool psram_stage_write(const uint8_t addr[], uint16_t file_index, uint32_t file_size, uint32_t file_offset, const uint8_t *data, uint16_t btw);
+bool psram_stage_empty(void);
+// returns window_size scaled down by how full the arena is
+uint16_t psram_stage_window_size(uint16_t window_size);
+// writes everything in the arena to the SD card, closes the file and waits until done
+void psram_stage_drain(void);
+
+#endif
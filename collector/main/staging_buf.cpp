@@ -0,0 +1,132 @@
+#include <string.h>
+#include "esp_heap_caps.h"
+
+#include "staging_buf.h"
+
+bool staging_init(staging_buf_t *sb, uint32_t size, uint32_t flush_size) {
+  if (flush_size == 0 || size % flush_size != 0) return false;
+
+  // DMA capable so that the SD driver does not have to bounce each sector
+  sb->buf = (uint8_t *) heap_caps_malloc(size, MALLOC_CAP_DMA);
+  if (sb->buf == NULL) return false;
+
+  sb->size = size;
+  sb->flush_size = flush_size;
+  staging_reset(sb, 0);
+
+  return true;
+}
+
+void staging_reset(staging_buf_t *sb, uint32_t phase) {
+  sb->head = phase % sb->flush_size;
+  sb->tail = sb->head;
+  sb->num_extents = 0;
+}
+
+uint32_t staging_count(const staging_buf_t *sb) {
+  return sb->head - sb->tail;
+}
+
+uint32_t staging_free(const staging_buf_t *sb) {
+  return sb->size - staging_count(sb);
+}
+
+static void copy_in(staging_buf_t *sb, uint32_t start, const uint8_t *data, uint32_t len) {
+  uint32_t pos = start % sb->size;
+  uint32_t first = sb->size - pos;
+
+  if (len <= first) {
+    memcpy(sb->buf + pos, data, len);
+  } else {
+    memcpy(sb->buf + pos, data, first);
+    memcpy(sb->buf, data + first, len - first);
+  }
+}
+
+// adds [start, end) to extents, merging it with any extents it touches
+static bool add_extent(staging_buf_t *sb, uint32_t start, uint32_t end) {
+  uint8_t i = 0;
+  // first extent that ends at or after start
+  while (i < sb->num_extents && sb->extents[i].end < start) i++;
+
+  // last extent (exclusive) that starts at or before end
+  uint8_t j = i;
+  while (j < sb->num_extents && sb->extents[j].start <= end) j++;
+
+  if (i == j) {
+    // touches nothing, insert new extent at i
+    if (sb->num_extents == STAGING_MAX_EXTENTS) return false;
+
+    memmove(&sb->extents[i + 1], &sb->extents[i], (sb->num_extents - i) * sizeof(staging_extent_t));
+    sb->extents[i].start = start;
+    sb->extents[i].end = end;
+    sb->num_extents ++;
+    return true;
+  }
+
+  // merge extents [i, j) into extents[i]
+  if (sb->extents[i].start < start) start = sb->extents[i].start;
+  if (sb->extents[j - 1].end > end) end = sb->extents[j - 1].end;
+
+  sb->extents[i].start = start;
+  sb->extents[i].end = end;
+
+  memmove(&sb->extents[i + 1], &sb->extents[j], (sb->num_extents - j) * sizeof(staging_extent_t));
+  sb->num_extents -= j - i - 1;
+  return true;
+}
+
+staging_result_t staging_write(staging_buf_t *sb, uint32_t offset, const uint8_t *data, uint32_t len) {
+  uint32_t start = sb->tail + offset;
+  uint32_t end = start + len;
+
+  if (end - sb->tail > sb->size) return STAGING_NO_SPACE;
+
+  // skip the part that is already contiguous
+  if (start < sb->head) {
+    if (end <= sb->head) return STAGING_OK;
+
+    data += sb->head - start;
+    start = sb->head;
+  }
+
+  if (start == sb->head) {
+    copy_in(sb, start, data, end - start);
+    sb->head = end;
+  } else {
+    // copying again over already filled ranges is harmless as a retransmit carries the same data
+    if (!add_extent(sb, start, end)) return STAGING_NO_EXTENT;
+    copy_in(sb, start, data, end - start);
+  }
+
+  // absorb extents that are now contiguous with head
+  uint8_t absorbed = 0;
+  while (absorbed < sb->num_extents && sb->extents[absorbed].start <= sb->head) {
+    if (sb->extents[absorbed].end > sb->head) sb->head = sb->extents[absorbed].end;
+    absorbed ++;
+  }
+
+  if (absorbed > 0) {
+    memmove(&sb->extents[0], &sb->extents[absorbed], (sb->num_extents - absorbed) * sizeof(staging_extent_t));
+    sb->num_extents -= absorbed;
+  }
+
+  return STAGING_OK;
+}
+
+uint32_t staging_peek(const staging_buf_t *sb, uint8_t **region, bool partial) {
+  uint32_t pos = sb->tail % sb->size;
+  uint32_t to_boundary = sb->flush_size - (sb->tail % sb->flush_size);
+  uint32_t count = staging_count(sb);
+
+  *region = sb->buf + pos;
+
+  if (count >= to_boundary) return to_boundary;
+  if (partial) return count;
+
+  return 0;
+}
+
+void staging_release(staging_buf_t *sb, uint32_t len) {
+  sb->tail += len;
+}
@@ -0,0 +1,70 @@
+#ifndef STAGING_BUF_H
+#define STAGING_BUF_H
+
+#include <stdint.h>
+
+// maximum number of separate filled ranges ahead of head
+static const uint8_t STAGING_MAX_EXTENTS = 16;
+
+/*
+  contiguous buffer that received blocks are copied into once, and which is then
+  handed to write() directly in flush_size regions
+
+  size is a multiple of flush_size, so a region between two multiples of
+  flush_size never wraps around the end of the buffer
+
+  blocks can be written anywhere in [tail, tail + size), in any order. data in
+  [tail, head) is contiguous and can be written out, filled ranges after head are
+  kept in extents until the gaps before them are filled
+
+  positions are byte counts since the last staging_reset, the position in buf
+  is (count % size). none of these functions lock, callers serialise access
+*/
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+} staging_extent_t;
+
+typedef struct {
+  uint8_t *buf;
+  uint32_t size;
+  uint32_t flush_size;
+
+  // end of the data filled contiguously from tail
+  uint32_t head;
+  // bytes released by the consumer
+  uint32_t tail;
+
+  // filled ranges after head, sorted and not touching each other or head
+  staging_extent_t extents[STAGING_MAX_EXTENTS];
+  uint8_t num_extents;
+} staging_buf_t;
+
+typedef enum {
+  STAGING_OK,
+  // the block is past the end of the buffer
+  STAGING_NO_SPACE,
+  // the block would create more than STAGING_MAX_EXTENTS filled ranges
+  STAGING_NO_EXTENT
+} staging_result_t;
+
+bool staging_init(staging_buf_t *sb, uint32_t size, uint32_t flush_size);
+// empties the buffer. the first flush region is shortened to (flush_size - phase)
+void staging_reset(staging_buf_t *sb, uint32_t phase);
+
+// bytes in [tail, head)
+uint32_t staging_count(const staging_buf_t *sb);
+// bytes after head up to the end of the buffer
+uint32_t staging_free(const staging_buf_t *sb);
+
+// copies len bytes into the buffer at tail + offset
+// ranges that are already filled or already released are skipped
+staging_result_t staging_write(staging_buf_t *sb, uint32_t offset, const uint8_t *data, uint32_t len);
+
+// points region at the next contiguous region to write out and returns its length
+// only complete flush regions are returned unless partial is set
+uint32_t staging_peek(const staging_buf_t *sb, uint8_t **region, bool partial);
+// marks len bytes from the start of the region returned by staging_peek as written out
+void staging_release(staging_buf_t *sb, uint32_t len);
+
+#endif
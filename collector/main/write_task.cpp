@@ -2,47 +2,173 @@
 #include "string.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/ringbuf.h"
 #include "freertos/semphr.h"
 
 #include "esp_log.h"
 
 #include "common.h"
+#include "staging_buf.h"
+#include "manifest.h"
 #include "write_task.h"
 
 SemaphoreHandle_t start_write;
 SemaphoreHandle_t buffer_empty;
+// given by write_task whenever it frees space in staging
+SemaphoreHandle_t space_available;
 
-// used to lock access to write_buffer
+// used to lock access to staging
 SemaphoreHandle_t buffer_update;
-RingbufHandle_t write_buffer;
+staging_buf_t staging;
+
+// set by wait_for_close to have write_task write out partial regions and close the file
+volatile bool closing = false;
+// set while the last write() to the open file failed
+static volatile bool write_failed = false;
 
 FILE *fp;
+char fname[LEN_MAX_FNAME];
 uint8_t peer_addr[6];
 uint16_t file_index = 0;
+// file offset of the first byte in staging
 uint32_t base_file_offset = 0;
 
+// size the open file was extended to, 0 if not preallocated
+uint32_t preallocated_size = 0;
+// blocks that could not be stored and files closed with data missing, see write_error_count
+static volatile uint32_t num_write_errors = 0;
+
 static const char *TAG = "write_task";
 
+// largest region written out at once, so staging fits in RAM on cards with large clusters
+static const uint32_t MAX_REGION_SIZE = 32 * 1024;
+
+// records a preallocated file and the offset up to which it holds valid data
+// so that the file can be truncated back if power is lost before it is closed
+// only the contiguous part of a download is ever written out, so this single
+// offset is the whole on-card extent map of the file
+static const char *JOURNAL_NAME = "journal";
+
+typedef struct {
+  char fname[LEN_MAX_FNAME];
+  // the file on the node, so the manifest can resume the download from valid_size
+  uint8_t addr[6];
+  uint16_t file_index;
+  uint32_t valid_size;
+} journal_t;
+
+// kept open while a preallocated file is open so valid_size can be updated in place
+static FILE *jfp = NULL;
+static journal_t journal;
+
+// the journal is only brought up to date after this many bytes, each update costs two fsyncs
+// data after valid_size is lost to a power cut and downloaded again, so this bounds the loss
+static const uint32_t JOURNAL_INTERVAL = 256 * 1024;
+
+static void get_journal_path(char *out) {
+  snprintf(out, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, JOURNAL_NAME);
+}
+
+// overwrites the journal with the current valid_size and flushes it to the card
+static bool journal_update(uint32_t valid_size) {
+  journal.valid_size = valid_size;
+
+  if (fseek(jfp, 0, SEEK_SET) != 0) return false;
+  if (fwrite(&journal, sizeof(journal_t), 1, jfp) != 1) return false;
+  if (fflush(jfp) != 0) return false;
+
+  return fsync(fileno(jfp)) == 0;
+}
+
+static bool journal_write(const char *path, uint32_t valid_size) {
+  char journal_path[LEN_MAX_FNAME];
+  get_journal_path(journal_path);
+
+  memset(&journal, 0, sizeof(journal_t));
+  strncpy(journal.fname, path, LEN_MAX_FNAME - 1);
+  memcpy(journal.addr, peer_addr, 6);
+  journal.file_index = file_index;
+
+  jfp = fopen(journal_path, "w");
+  if (jfp == NULL) {
+    ESP_LOGE(TAG, "fopen %s failed", journal_path);
+    return false;
+  }
+
+  return journal_update(valid_size);
+}
+
+static void journal_clear(void) {
+  char journal_path[LEN_MAX_FNAME];
+  get_journal_path(journal_path);
+
+  if (jfp != NULL) {
+    fclose(jfp);
+    jfp = NULL;
+  }
+
+  remove(journal_path);
+}
+
+void write_recover(void) {
+  char journal_path[LEN_MAX_FNAME];
+  get_journal_path(journal_path);
+
+  FILE *old = fopen(journal_path, "r");
+  if (old == NULL) return;
+
+  bool ok = fread(&journal, sizeof(journal_t), 1, old) == 1;
+  fclose(old);
+
+  if (ok) {
+    journal.fname[LEN_MAX_FNAME - 1] = '\0';
+    ESP_LOGW(TAG, "%s was not closed, truncating to %d", journal.fname, journal.valid_size);
+
+    if (truncate(journal.fname, journal.valid_size) != 0) {
+      ESP_LOGE(TAG, "truncate %s failed", journal.fname);
+    } else {
+      // the manifest is only saved when a file is closed, so it is behind the journal
+      manifest_set(journal.addr, journal.file_index, journal.valid_size);
+      manifest_save();
+    }
+  }
+
+  journal_clear();
+}
+
+// extends the open file to size so its clusters are allocated once up front
+// instead of one at a time as the file grows
+static bool preallocate(uint32_t file_offset, uint32_t size) {
+  preallocated_size = 0;
+
+  off_t cur_size = lseek(fileno(fp), 0, SEEK_END);
+  if (cur_size == -1 || (uint32_t) cur_size >= size) return true;
+
+  if (!journal_write(fname, file_offset)) return false;
+
+  // writing the last byte makes FATFS allocate the cluster chain up to it
+  const uint8_t zero = 0;
+  if (lseek(fileno(fp), size - 1, SEEK_SET) == -1 || write(fileno(fp), &zero, 1) != 1) {
+    ESP_LOGW(TAG, "failed to preallocate %s to %d", fname, size);
+    journal_clear();
+    return false;
+  }
+
+  preallocated_size = size;
+  return true;
+}
+
 void wait_for_close(void) {
   if (file_index == 0) return;
 
   ESP_LOGI(TAG, "waiting for %d to close", file_index);
-  if (xRingbufferGetCurFreeSize(write_buffer) > 0) {
-    // try take the semphr to clear it
-    // because its only given on empty, but not taken on not empty
-    xSemaphoreTake(buffer_empty, 0);
-  }
 
-  // start write to clear buffer
-  xSemaphoreGive(start_write);
-  // start another write to trigger file close after buffer_empty
+  closing = true;
   xSemaphoreGive(start_write);
   xSemaphoreTake(buffer_empty, portMAX_DELAY);
   ESP_LOGI(TAG, "closed");
 }
 
-bool write_sd(uint8_t addr[], uint16_t _file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
+bool write_sd(uint8_t addr[], uint16_t _file_index, uint32_t file_size, uint32_t file_offset, const uint8_t *data, uint16_t btw) {
   if (file_index != _file_index || memcmp(addr, peer_addr, 6) != 0) {
     if (memcmp(addr, peer_addr, 6) != 0) {
       memcpy(peer_addr, addr, 6);
@@ -52,107 +178,221 @@ bool write_sd(uint8_t addr[], uint16_t _file_index, uint32_t file_offset, const
       wait_for_close();
     }
 
-    char fname[LEN_MAX_FNAME];
     get_addr_id_path(addr, _file_index, fname);
 
     // `r+` is used here because `a` does not allow writing to the middle of the file
     // but `r+` fails if the file does not exist, so open in `w` (create new) if so
     fp = fopen(fname, "r+");
     if (fp == NULL) {
+      make_parent_dirs(fname);
       fp = fopen(fname, "w");
       if (fp == NULL) {
         ESP_LOGE(TAG, "fopen %s failed", fname);
+        num_write_errors ++;
         return false;
       }
     }
 
     ESP_LOGI(TAG, "fopen %d", _file_index);
 
+    if (file_size > 0 && !preallocate(file_offset, file_size)) {
+      ESP_LOGW(TAG, "continuing without preallocation");
+    }
+
     if (lseek(fileno(fp), file_offset, SEEK_SET) == -1) {
       ESP_LOGW(TAG, "failed to seek to %d", file_offset);
       fclose(fp);
+      num_write_errors ++;
       return false;
     }
 
+    // staging is empty here because the previous file (if any) has been closed
+    // start it at the same phase as file_offset so every region written out ends on
+    // a cluster boundary of the file
+    staging_reset(&staging, file_offset);
+
     file_index = _file_index;
     base_file_offset = file_offset;
   }
 
   while(1) {
     xSemaphoreTake(buffer_update, portMAX_DELAY);
-    uint32_t buffer_count = CONFIG_WRITE_BUF_SIZE * 2 - xRingbufferGetCurFreeSize(write_buffer);
-    uint32_t cur_offset = base_file_offset + buffer_count;
-    if (cur_offset != file_offset) {
-      ESP_LOGW(TAG, "offset mismatch: writing to %d but cur is %d", file_offset, cur_offset);
-      xSemaphoreGive(buffer_update);
-      return false;
+
+    if (file_offset < base_file_offset) {
+      // (part of) a retransmit of data that has already been written out
+      uint32_t skip = base_file_offset - file_offset;
+      if (skip >= btw) {
+        xSemaphoreGive(buffer_update);
+        return true;
+      }
+
+      data += skip;
+      btw -= skip;
+      file_offset = base_file_offset;
     }
 
-    if (xRingbufferSend(write_buffer, data, btw, 0) == pdTRUE) {
-      // if this fails, we have to give up because the buffer cant get cleared
-      // until we release buffer_update
-      xSemaphoreGive(buffer_update);
+    staging_result_t ret = staging_write(&staging, file_offset - base_file_offset, data, btw);
+    uint32_t buffer_count = staging_count(&staging);
+    xSemaphoreGive(buffer_update);
 
-      // if we have more than CONFIG_WRITE_BUF_SIZE, signal to start write
-      if (buffer_count + btw > CONFIG_WRITE_BUF_SIZE) {
+    if (ret == STAGING_OK) {
+      // if a full region is ready, signal to start write
+      if (buffer_count >= staging.flush_size - (base_file_offset % staging.flush_size)) {
         xSemaphoreGive(start_write);
       }
       return true;
     }
-    xSemaphoreGive(buffer_update);
+
+    if (ret == STAGING_NO_EXTENT || buffer_count == 0) {
+      // waiting does not help: the gap at the start of staging has to be filled by
+      // a retransmit first, which cannot be received while this blocks
+      ESP_LOGW(TAG, "too fragmented to store block at %d, dropping", file_offset);
+      num_write_errors ++;
+      return false;
+    }
+
+    // staging is full, so the SD card is behind. make sure the full regions are being
+    // written out, then block until space frees up. while blocked no acks go out, so
+    // the node stops sending once its window is used up
+    xSemaphoreGive(start_write);
+    if (xSemaphoreTake(space_available, pdMS_TO_TICKS(CONFIG_WRITE_STALL_TIMEOUT)) == pdFALSE) {
+      ESP_LOGW(TAG, "no space in staging after %dms, dropping block at %d", CONFIG_WRITE_STALL_TIMEOUT, file_offset);
+      num_write_errors ++;
+      return false;
+    }
   }
 }
 
-void write_task(void *pvParameter) {
+uint32_t write_error_count(void) {
+  return num_write_errors;
+}
+
+uint32_t write_region_size(void) {
+  return staging.flush_size;
+}
+
+uint32_t write_staging_size(void) {
+  return staging.size;
+}
+
+uint16_t write_window_size(uint16_t window_size) {
+  xSemaphoreTake(buffer_update, portMAX_DELAY);
+  uint32_t free = staging_free(&staging);
+  xSemaphoreGive(buffer_update);
+
+  // shrink the window in proportion to the free space in staging so a node
+  // does not send more than can be buffered while the SD card catches up
+  uint16_t scaled = (uint32_t) window_size * free / staging.size;
+
+  if (scaled == 0) return 1;
+  return scaled;
+}
+
+void write_init(void) {
   buffer_empty = xSemaphoreCreateBinary();
   buffer_update = xSemaphoreCreateBinary();
   start_write = xSemaphoreCreateCounting(2, 0);
-  xSemaphoreGive(buffer_update);
-  write_buffer = xRingbufferCreate(CONFIG_WRITE_BUF_SIZE * 2, RINGBUF_TYPE_BYTEBUF);
+  space_available = xSemaphoreCreateBinary();
 
-  // allocate yet another buffer to actually hold data right before writing to SD because
-  // the ring buffer may not store stuff sequentially
-  char *write_buf = (char *) malloc(CONFIG_WRITE_BUF_SIZE);
-  uint32_t write_buf_count = 0;
+  // regions are handed to write() straight out of staging, so no second buffer is needed
+  // regions are one cluster of the card long, and there are at least two of them
+  // cluster sizes are powers of two, so a capped region still ends on cluster boundaries
+  uint32_t region_size = sd_cluster_size < MAX_REGION_SIZE ? sd_cluster_size : MAX_REGION_SIZE;
+  uint32_t num_units = (CONFIG_WRITE_BUF_SIZE * 2 + region_size - 1) / region_size;
+  if (num_units < 2) num_units = 2;
 
-  size_t size;
+  ESP_LOGI(TAG, "writing in regions of %d bytes", region_size);
 
+  if (!staging_init(&staging, num_units * region_size, region_size)) {
+    ESP_LOGE(TAG, "failed to allocate staging buffer");
+    abort();
+  }
+  xSemaphoreGive(buffer_update);
+}
+
+void write_task(void *pvParameter) {
   while(1) {
     xSemaphoreTake(start_write, 100 / portTICK_PERIOD_MS);
 
-    uint8_t *buf = (uint8_t *) xRingbufferReceiveUpTo(write_buffer, &size, 0, CONFIG_WRITE_BUF_SIZE);
+    if (file_index == 0) continue;
 
-    if (buf == NULL) {
-      if (file_index == 0) continue;
+    bool partial = closing;
 
-      ESP_LOGI(TAG, "fclose %d", file_index);
-      fclose(fp);
-      file_index = 0;
+    while(1) {
+      uint8_t *region;
 
-      xSemaphoreGive(buffer_empty);
-      continue;
-    }
+      xSemaphoreTake(buffer_update, portMAX_DELAY);
+      uint32_t len = staging_peek(&staging, &region, partial);
+      xSemaphoreGive(buffer_update);
 
-    memcpy(write_buf, buf, size);
-    write_buf_count = size;
+      if (len == 0) break;
 
-    xSemaphoreTake(buffer_update, portMAX_DELAY);
-    vRingbufferReturnItem(write_buffer, buf);
-    base_file_offset += size;
-    
-    // read more because the ringbuffer may not store sequentially
-    if (size < CONFIG_WRITE_BUF_SIZE) {
-      buf = (uint8_t *) xRingbufferReceiveUpTo(write_buffer, &size, 0, CONFIG_WRITE_BUF_SIZE - write_buf_count);
-      if (buf != NULL) {
-        memcpy(write_buf + write_buf_count, buf, size);
-        write_buf_count += size;
-        vRingbufferReturnItem(write_buffer, buf);
-        base_file_offset += size;
+      // staging is not locked here: the producer only writes outside [tail, head)
+      ssize_t ret = write(fileno(fp), region, len);
+      uint32_t written = ret > 0 ? ret : 0;
+
+      // only what reached the card leaves staging, the rest is retried on the next round
+      if (written > 0) {
+        xSemaphoreTake(buffer_update, portMAX_DELAY);
+        staging_release(&staging, written);
+        base_file_offset += written;
+        xSemaphoreGive(buffer_update);
+
+        xSemaphoreGive(space_available);
+
+        if (preallocated_size != 0 && base_file_offset - journal.valid_size >= JOURNAL_INTERVAL) {
+          // the data has to be on the card before the journal says it is valid
+          if (fsync(fileno(fp)) != 0 || !journal_update(base_file_offset)) {
+            ESP_LOGW(TAG, "failed to update journal of %d at %d", file_index, base_file_offset);
+          }
+        }
+      }
+
+      if (written != len) {
+        ESP_LOGE(TAG, "write of %d bytes to %d at %d failed after %d bytes", len, file_index, base_file_offset - written, written);
+        write_failed = true;
+
+        // the retry continues from the end of what was written
+        lseek(fileno(fp), base_file_offset, SEEK_SET);
+        break;
       }
+
+      write_failed = false;
     }
 
-    xSemaphoreGive(buffer_update);
+    if (partial && write_failed) {
+      ESP_LOGE(TAG, "closing %d at %d, %d staged bytes could not be written", file_index, base_file_offset, staging_count(&staging));
+      num_write_errors ++;
+    } else if (partial && staging.num_extents > 0) {
+      ESP_LOGW(TAG, "closing %d with %d ranges after offset %d not written", file_index, staging.num_extents, base_file_offset);
+      num_write_errors ++;
+    }
+
+    if (partial) {
+      ESP_LOGI(TAG, "fclose %d", file_index);
+      fclose(fp);
+
+      if (preallocated_size != 0) {
+        // drop the part of the preallocation that was not received
+        if (base_file_offset < preallocated_size && truncate(fname, base_file_offset) != 0) {
+          ESP_LOGE(TAG, "truncate %s to %d failed", fname, base_file_offset);
+        }
+        journal_clear();
+        preallocated_size = 0;
+      }
+
+      // base_file_offset only counts what was written, so the rest is downloaded again next time
+      manifest_set(peer_addr, file_index, base_file_offset);
 
-    write(fileno(fp), write_buf, write_buf_count);
+      xSemaphoreTake(buffer_update, portMAX_DELAY);
+      staging_reset(&staging, 0);
+      xSemaphoreGive(buffer_update);
+
+      file_index = 0;
+      closing = false;
+      write_failed = false;
+
+      xSemaphoreGive(buffer_empty);
+    }
   }
 }
@@ -2,7 +2,23 @@
 #define WRITE_TASK_
 
 void wait_for_close(void);
-bool write_sd(uint8_t addr[], uint16_t file_index, uint32_t file_offset, const uint8_t *data, uint16_t btw);
+// file_size is the size of file_index on the node, used to preallocate the file when it is
+// opened. 0 if not known
+bool write_sd(uint8_t addr[], uint16_t file_index, uint32_t file_size, uint32_t file_offset, const uint8_t *data, uint16_t btw);
+// number of blocks write_sd failed to store and of files closed with data missing since startup
+uint32_t write_error_count(void);
+// size of the regions data is written out in, a single write_sd of up to this always fits
+uint32_t write_region_size(void);
+// size of the staging buffer, write_sd can place blocks up to this far past the last byte written out
+uint32_t write_staging_size(void);
+// returns window_size scaled down by how full the write buffer is
+// the open file is only closed once the next one starts, so this includes the end of the last read
+uint16_t write_window_size(uint16_t window_size);
+// allocates buffers, call before starting write_task
+void write_init(void);
+// truncates a file left preallocated by an unclean shutdown back to the data journaled as
+// written, and sets it in the manifest. call after manifest_init
+void write_recover(void);
 void write_task(void *pvParameter);
 
 #endif
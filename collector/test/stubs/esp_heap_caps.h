@@ -0,0 +1,16 @@
+#ifndef ESP_HEAP_CAPS_H
+#define ESP_HEAP_CAPS_H
+
+// host stand-in for the ESP-IDF allocator, the capabilities do not matter off target
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+static inline void *heap_caps_malloc(size_t size, uint32_t caps) {
+  (void) caps;
+  return malloc(size);
+}
+
+#endif
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "staging_buf.h"
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    num_failed ++; \
+  } \
+} while (0)
+
+// data bytes in an mtftp block
+static const uint32_t BLOCK_SIZE = 240;
+// staging as write_init sets it up for a card with 4 KB clusters
+static const uint32_t REGION_SIZE = 4096;
+static const uint32_t NUM_REGIONS = 4;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t len;
+} block_t;
+
+// the SD card side of write_task. regions are copied to out, and each one is checked to
+// continue from the last and to end on a region boundary of the file
+typedef struct {
+  staging_buf_t *sb;
+  uint8_t *out;
+  const uint8_t *src;
+  // file offset of the tail of staging
+  uint32_t base_file_offset;
+  uint32_t num_flushes;
+  // every third write() is short, like a card that fails part way through a region
+  bool short_writes;
+} card_t;
+
+static void flush(card_t *card, bool partial) {
+  while (1) {
+    uint8_t *region;
+    uint32_t len = staging_peek(card->sb, &region, partial);
+    if (len == 0) break;
+
+    CHECK(region == card->sb->buf + card->sb->tail % card->sb->size);
+    if (!partial) CHECK((card->base_file_offset + len) % REGION_SIZE == 0);
+
+    uint32_t written = len;
+    if (card->short_writes && card->num_flushes % 3 == 2 && len > 1) written = len / 2;
+
+    CHECK(memcmp(region, card->src + card->base_file_offset, written) == 0);
+    memcpy(card->out + card->base_file_offset, region, written);
+
+    staging_release(card->sb, written);
+    card->base_file_offset += written;
+    card->num_flushes ++;
+  }
+}
+
+// blocks of [start, size) in order, then each window of `reorder` blocks shuffled
+static std::vector<block_t> make_blocks(uint32_t start, uint32_t size, uint32_t reorder) {
+  std::vector<block_t> blocks;
+  for (uint32_t offset = start; offset < size; offset += BLOCK_SIZE) {
+    block_t block = {offset, size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE};
+    blocks.push_back(block);
+  }
+
+  if (reorder > 1) {
+    for (uint32_t i = 0; i < blocks.size(); i += reorder) {
+      uint32_t n = blocks.size() - i < reorder ? blocks.size() - i : reorder;
+      for (uint32_t j = n - 1; j > 0; j--) {
+        uint32_t k = rand() % (j + 1);
+        block_t tmp = blocks[i + j];
+        blocks[i + j] = blocks[i + k];
+        blocks[i + k] = tmp;
+      }
+    }
+  }
+
+  return blocks;
+}
+
+// downloads [start, size) of src through staging, as write_sd and write_task do, and
+// returns the seconds taken
+static double download(const uint8_t *src, uint32_t start, uint32_t size, uint32_t reorder, bool retransmits, bool short_writes) {
+  staging_buf_t sb;
+  CHECK(staging_init(&sb, NUM_REGIONS * REGION_SIZE, REGION_SIZE));
+  staging_reset(&sb, start);
+
+  std::vector<uint8_t> out(size, 0);
+  card_t card = {&sb, out.data(), src, start, 0, short_writes};
+
+  std::vector<block_t> blocks = make_blocks(start, size, reorder);
+
+  clock_t begin = clock();
+
+  for (uint32_t i = 0; i < blocks.size(); i++) {
+    const block_t *block = &blocks[i];
+
+    // a retransmit of a block that has already been received, or written out
+    if (retransmits && i % 7 == 3) {
+      const block_t *again = &blocks[i - 3];
+      if (again->offset >= card.base_file_offset) {
+        CHECK(staging_write(&sb, again->offset - card.base_file_offset, src + again->offset, again->len) == STAGING_OK);
+      }
+    }
+
+    if (block->offset < card.base_file_offset) continue;
+
+    staging_result_t ret = staging_write(&sb, block->offset - card.base_file_offset, src + block->offset, block->len);
+    if (ret == STAGING_NO_SPACE) {
+      // write_sd waits for write_task to make space
+      flush(&card, false);
+      ret = staging_write(&sb, block->offset - card.base_file_offset, src + block->offset, block->len);
+    }
+
+    CHECK(ret == STAGING_OK);
+    flush(&card, false);
+  }
+
+  // the file is closed
+  flush(&card, true);
+
+  double seconds = (double) (clock() - begin) / CLOCKS_PER_SEC;
+
+  CHECK(card.base_file_offset == size);
+  CHECK(sb.num_extents == 0);
+  CHECK(memcmp(out.data() + start, src + start, size - start) == 0);
+
+  free(sb.buf);
+  return seconds;
+}
+
+static void test_streams(void) {
+  const uint32_t size = 1024 * 1024 + 123;
+  std::vector<uint8_t> src(size);
+  for (uint32_t i = 0; i < size; i++) src[i] = rand();
+
+  // resuming at an offset that is not on a region boundary shortens the first region
+  const uint32_t starts[] = {0, 1000, REGION_SIZE, 3 * REGION_SIZE - 1};
+  for (uint32_t start : starts) {
+    download(src.data(), start, size, 1, false, false);
+    download(src.data(), start, size, 8, false, false);
+    download(src.data(), start, size, 8, true, false);
+    download(src.data(), start, size, 8, true, true);
+  }
+}
+
+static void test_limits(void) {
+  staging_buf_t sb;
+  CHECK(!staging_init(&sb, 3 * REGION_SIZE + 1, REGION_SIZE));
+  CHECK(staging_init(&sb, NUM_REGIONS * REGION_SIZE, REGION_SIZE));
+
+  uint8_t data[2 * BLOCK_SIZE];
+  memset(data, 0xA5, sizeof(data));
+
+  // one block past the end of the buffer
+  CHECK(staging_write(&sb, NUM_REGIONS * REGION_SIZE - BLOCK_SIZE + 1, data, BLOCK_SIZE) == STAGING_NO_SPACE);
+
+  // every other block, each one a separate range after head
+  for (uint32_t i = 0; i < STAGING_MAX_EXTENTS; i++) {
+    CHECK(staging_write(&sb, (2 * i + 1) * BLOCK_SIZE, data, BLOCK_SIZE) == STAGING_OK);
+  }
+  CHECK(sb.num_extents == STAGING_MAX_EXTENTS);
+  CHECK(staging_write(&sb, (2 * STAGING_MAX_EXTENTS + 1) * BLOCK_SIZE, data, BLOCK_SIZE) == STAGING_NO_EXTENT);
+
+  // filling the gaps joins them all up with head
+  for (uint32_t i = 0; i < STAGING_MAX_EXTENTS; i++) {
+    CHECK(staging_write(&sb, 2 * i * BLOCK_SIZE, data, BLOCK_SIZE) == STAGING_OK);
+  }
+  CHECK(sb.num_extents == 0);
+  CHECK(staging_count(&sb) == 2 * STAGING_MAX_EXTENTS * BLOCK_SIZE);
+
+  // a block that covers a range after head entirely, as when the block size changes
+  staging_reset(&sb, 0);
+  CHECK(staging_write(&sb, 100, data, 100) == STAGING_OK);
+  CHECK(staging_write(&sb, 0, data, 300) == STAGING_OK);
+  CHECK(sb.num_extents == 0);
+  CHECK(staging_count(&sb) == 300);
+
+  free(sb.buf);
+}
+
+// throughput of staging_write and the region copy-out, on the host
+static void benchmark(void) {
+  const uint32_t size = 16 * 1024 * 1024;
+  std::vector<uint8_t> src(size);
+  for (uint32_t i = 0; i < size; i++) src[i] = rand();
+
+  double in_order = download(src.data(), 0, size, 1, false, false);
+  double reordered = download(src.data(), 0, size, 8, false, false);
+
+  printf("test_staging_buf: in order %.0f MB/s, reordered %.0f MB/s\n",
+    size / in_order / 1e6, size / reordered / 1e6);
+}
+
+int main(void) {
+  srand(1);
+
+  test_limits();
+  test_streams();
+  benchmark();
+
+  if (num_failed > 0) {
+    printf("test_staging_buf: %d checks failed\n", num_failed);
+    return 1;
+  }
+
+  printf("test_staging_buf: passed\n");
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include "clock.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+// the phase error is removed at 1/PHASE_GAIN per second
+static const int64_t PHASE_GAIN = 2;
+// and 1/FREQ_GAIN of it is added to the frequency estimate
+static const int64_t FREQ_GAIN = 16;
+// limits on the frequency estimate and on the total rate (ppb)
+// keeping the rate well above -1e9 is what makes the clock monotonic
+static const int64_t MAX_FREQ = 200000;
+static const int64_t MAX_RATE = 500000;
+// edges further apart than this (us) are not used to estimate frequency
+static const int64_t MAX_EDGE_INTERVAL = 10000000;
+
+static portMUX_TYPE clock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool valid = false;
+// the clock is base_utc (ns) at base_local, and runs at 1 + rate / 1e9 from there
+static int64_t base_local;
+static uint64_t base_utc;
+static int64_t rate;
+// estimated frequency error of esp_timer (ppb)
+static int64_t freq;
+static int64_t last_offset;
+
+static int64_t clamp(int64_t x, int64_t limit) {
+  if (x > limit) return limit;
+  if (x < -limit) return -limit;
+  return x;
+}
+
+// UTC in ns at local_us, clock_mux must be held
+static uint64_t from_local(int64_t local_us) {
+  int64_t dt = local_us - base_local;
+  return base_utc + dt * 1000 + dt * rate / 1000000;
+}
+
+bool clock_on_pps(int64_t local_us, uint64_t utc_ns) {
+  bool step = false;
+
+  portENTER_CRITICAL(&clock_mux);
+
+  int64_t offset = 0;
+  if (valid) offset = (int64_t) (utc_ns - from_local(local_us));
+
+  // a clock that is ahead is always slewed back at the rate limit, so it never runs backwards
+  if (!valid || offset > CLOCK_STEP_THRESHOLD * 1000) {
+    base_utc = utc_ns;
+    if (!valid) freq = 0;
+    step = true;
+  } else {
+    // continue from where the clock is now, and steer towards the edge
+    base_utc = from_local(local_us);
+
+    // a large error is a phase jump, not a frequency error
+    bool locked = offset <= CLOCK_LOCK_THRESHOLD * 1000 && offset >= -CLOCK_LOCK_THRESHOLD * 1000;
+    if (locked && local_us - base_local < MAX_EDGE_INTERVAL) {
+      // an error of 1ns after a second is 1ppb
+      freq = clamp(freq + offset / FREQ_GAIN, MAX_FREQ);
+    }
+  }
+
+  base_local = local_us;
+  rate = step ? freq : clamp(freq + offset / PHASE_GAIN, MAX_RATE);
+  last_offset = clamp(offset, INT32_MAX);
+  valid = true;
+
+  portEXIT_CRITICAL(&clock_mux);
+
+  return step;
+}
+
+bool clock_valid(void) {
+  return valid;
+}
+
+uint64_t clock_from_local(int64_t local_us) {
+  portENTER_CRITICAL(&clock_mux);
+  uint64_t utc = from_local(local_us);
+  portEXIT_CRITICAL(&clock_mux);
+
+  return utc / 1000;
+}
+
+uint64_t clock_now(void) {
+  return clock_from_local(esp_timer_get_time());
+}
+
+void clock_get_stats(int32_t *offset_ns, int32_t *freq_ppb) {
+  portENTER_CRITICAL(&clock_mux);
+  *offset_ns = last_offset;
+  *freq_ppb = freq;
+  portEXIT_CRITICAL(&clock_mux);
+}
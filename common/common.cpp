@@ -1,6 +1,6 @@
 #include "common.h"
 
-#include <errno.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -11,15 +11,20 @@
 #include "esp_wifi.h"
 #include "esp_private/wifi.h"
 #include "esp_now.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 
 #include "esp_vfs_fat.h"
+#include "ff.h"
 #include "driver/sdmmc_host.h"
 #include "sdmmc_cmd.h"
 
 #include "board.h"
+#include "clock.h"
 
 const char *SD_MOUNT_POINT = "/sdcard";
+sdmmc_card_t *sd_card = NULL;
+uint32_t sd_cluster_size = SD_ALLOCATION_UNIT;
 const uint8_t SYNC_PACKET[LEN_SYNC_PACKET] = { 0x00, 0xf5, 0x3a, 0x72, 0x89, 0x13, 0x57, 0xa5 };
 
 void nvs_init(void) {
@@ -44,12 +49,21 @@ void wifi_init(void) {
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
   ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+
+  wifi_resume();
+}
+
+void wifi_resume(void) {
   ESP_ERROR_CHECK(esp_wifi_start());
 
   ESP_ERROR_CHECK(esp_wifi_set_channel(CONFIG_WIFI_CHANNEL, WIFI_SECOND_CHAN_NONE));
   ESP_ERROR_CHECK(esp_wifi_internal_set_fix_rate(ESP_IF_WIFI_STA, true, DATA_RATE));
 }
 
+void wifi_suspend(void) {
+  ESP_ERROR_CHECK(esp_wifi_stop());
+}
+
 void hw_init(void) {
   gpio_set_direction(GPIO_POWER_SEL, GPIO_MODE_OUTPUT);
   gpio_set_direction(GPIO_LED, GPIO_MODE_OUTPUT);
@@ -117,14 +131,13 @@ void sd_init(void) {
   esp_vfs_fat_mount_config_t mount_config = {
     .format_if_mount_failed = false,
     .max_files = 5,
-    .allocation_unit_size = 16 * 1024
+    .allocation_unit_size = SD_ALLOCATION_UNIT
   };
 
   aux_activate();
 
   vTaskDelay(500 / portTICK_RATE_MS);
 
-  sdmmc_card_t* card;
   sdmmc_host_t host = SDMMC_HOST_DEFAULT();
   host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
 
@@ -136,7 +149,7 @@ void sd_init(void) {
   gpio_set_pull_mode(GPIO_NUM_12, GPIO_PULLUP_ONLY);   // D2
   gpio_set_pull_mode(GPIO_NUM_13, GPIO_PULLUP_ONLY);   // D3
 
-  esp_err_t ret = esp_vfs_fat_sdmmc_mount(SD_MOUNT_POINT, &host, &slot_config, &mount_config, &card);
+  esp_err_t ret = esp_vfs_fat_sdmmc_mount(SD_MOUNT_POINT, &host, &slot_config, &mount_config, &sd_card);
 
   if (ret != ESP_OK) {
     if (ret == ESP_FAIL) {
@@ -146,65 +159,37 @@ void sd_init(void) {
     ESP_ERROR_CHECK(ret);
   }
 
-  sdmmc_card_print_info(stdout, card);
-}
-
-bool conv_strtoul(char *str, uint16_t *num) {
-  errno = 0;
-  uint16_t val = strtoul(str, NULL, 10);
-  if (errno != 0) return false;
-
-  if (num != NULL) *num = val;
-
-  return true;
-}
-
-bool get_file_size(char *fname, uint32_t *size) {
-  const char *TAG = "get_file_size";
-
-  FILE *fp = fopen(fname, "r");
-
-  if (fp == NULL) {
-    return false;
-  }
-
-  if (fseeko(fp, 0, SEEK_END) != 0) {
-    ESP_LOGE(TAG, "fseek %s failed", fname);
-    return false;
+  sdmmc_card_print_info(stdout, sd_card);
+
+  // the card is the only FATFS volume, so it is drive 0
+  DWORD free_clusters;
+  FATFS *fs;
+  if (f_getfree("0:", &free_clusters, &fs) == FR_OK) {
+    #if FF_MAX_SS != FF_MIN_SS
+      sd_cluster_size = (uint32_t) fs->csize * fs->ssize;
+    #else
+      sd_cluster_size = (uint32_t) fs->csize * FF_MIN_SS;
+    #endif
+    ESP_LOGI(TAG, "cluster size %d bytes, %d clusters free", sd_cluster_size, free_clusters);
+  } else {
+    ESP_LOGW(TAG, "failed to read the cluster size, assuming %d bytes", sd_cluster_size);
   }
-
-  *size = ftello(fp);
-  fclose(fp);
-
-  ESP_LOGI(TAG, "file=%s has size=%d", fname, *size);
-
-  return true;
-}
-
-bool get_file_size(uint16_t file_index, uint32_t *size) {
-  char fname[LEN_MAX_FNAME];
-  snprintf(fname, LEN_MAX_FNAME, "%s/%d", SD_MOUNT_POINT, file_index);
-
-  return get_file_size(fname, size);
-}
-
-bool get_file_size(uint8_t addr[], uint16_t file_index, uint32_t *size) {
-  char fname[LEN_MAX_FNAME];
-  get_addr_id_path(addr, file_index, fname);
-
-  return get_file_size(fname, size);
-}
-
-void get_addr_id_path(uint8_t addr[], uint16_t file_index, char *out) {
-  snprintf(out, LEN_MAX_FNAME, "%s/%02X%02X%02X%02X%02X%02X-%d", SD_MOUNT_POINT, ARG_MAC(addr), file_index);
 }
 
 uint64_t get_time(void) {
+  if (clock_valid()) return clock_now();
+
   struct timeval tv_now;
   gettimeofday(&tv_now, NULL);
   return (uint64_t) tv_now.tv_sec * 1000000L + (uint64_t) tv_now.tv_usec;
 }
 
+uint64_t get_time_at(int64_t local_us) {
+  if (clock_valid()) return clock_from_local(local_us);
+
+  return get_time() - (esp_timer_get_time() - local_us);
+}
+
 esp_err_t espnow_add_peer(const uint8_t *peer_addr) {
   esp_now_peer_info_t peer;
   memset(&peer, 0, sizeof(esp_now_peer_info_t));
@@ -0,0 +1,41 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/*
+  UTC clock disciplined by the GPS PPS
+
+  esp_timer is the local timebase. each PPS edge is timestamped with esp_timer
+  and compared against where the clock predicted it. the error is removed with
+  a PI loop: the phase error is slewed out over the next second and the
+  frequency error of the oscillator is integrated, so the clock stays
+  continuous and monotonic. errors larger than CLOCK_LOCK_THRESHOLD are slewed
+  out at the rate limit without touching the frequency estimate. only the first
+  edge, or the clock being behind by more than CLOCK_STEP_THRESHOLD, steps the
+  clock. it is never stepped backwards once valid
+*/
+
+// errors up to this (us) are in the linear range of the loop and train the frequency estimate
+static const int64_t CLOCK_LOCK_THRESHOLD = 1000;
+// the clock is stepped forward if it is behind by more than this (us), smaller errors are slewed
+static const int64_t CLOCK_STEP_THRESHOLD = 128000;
+
+// feeds a PPS edge, timestamped at local_us by esp_timer, that happened at utc_ns
+// the model is kept in ns so sub-us corrections to utc_ns, and the averaging
+// of timestamp jitter, are not rounded away
+// returns true if the clock was stepped
+bool clock_on_pps(int64_t local_us, uint64_t utc_ns);
+
+// true once a PPS edge has been fed
+bool clock_valid(void);
+
+// UTC in us at the esp_timer time local_us
+uint64_t clock_from_local(int64_t local_us);
+// current UTC in us
+uint64_t clock_now(void);
+
+// error at the last PPS edge (ns) and the estimated oscillator frequency error (ppb)
+void clock_get_stats(int32_t *offset_ns, int32_t *freq_ppb);
+
+#endif
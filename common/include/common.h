@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "esp_err.h"
+#include "sdmmc_cmd.h"
 
 // TODO: shift this to kconfig
 #define DATA_RATE WIFI_PHY_RATE_24M
@@ -11,11 +12,21 @@
 // wifi alloc failure observed when > 32 are buffered
 static const uint8_t MAX_BUFFERED_TX = 8;
 
+// FAT allocation unit used when the SD card is formatted
+static const uint32_t SD_ALLOCATION_UNIT = 16 * 1024;
+// cluster size of the mounted SD card, set by sd_init. cards are never formatted by the
+// firmware, so this is whatever the card was formatted with and not SD_ALLOCATION_UNIT
+extern uint32_t sd_cluster_size;
+
 #define FORMAT_MAC "%02x:%02x:%02x:%02x:%02x:%02x"
 #define ARG_MAC(mac) (unsigned int) mac[0], (unsigned int) mac[1], (unsigned int) mac[2], (unsigned int) mac[3], (unsigned int) mac[4], (unsigned int) mac[5]
 
 void nvs_init(void);
 void wifi_init(void);
+// stops the radio, esp-now peers are kept
+void wifi_suspend(void);
+// restarts the radio on CONFIG_WIFI_CHANNEL after wifi_suspend
+void wifi_resume(void);
 void espnow_init(void);
 void sd_init(void);
 void hw_init(void);
@@ -23,14 +34,33 @@ void hw_init(void);
 void set_led(bool on);
 int get_btn_user(void);
 
+// parses a name made up only of digits into num, false for anything else
 bool conv_strtoul(char *str, uint16_t *num);
 bool get_file_size(uint8_t addr[], uint16_t file_index, uint32_t *size);
 bool get_file_size(uint16_t file_index, uint32_t *size);
 bool get_file_size(char *fname, uint32_t *size);
 
+/*
+  files are sharded into directories so no directory holds more than
+  FILES_PER_BUCKET files, because FAT directory lookups are linear
+    node:       /sdcard/B<bucket>/<index>
+    collector:  /sdcard/<MAC>/B<bucket>/<index>
+  where bucket is (index / FILES_PER_BUCKET) in hex
+*/
+static const uint16_t FILES_PER_BUCKET = 256;
+
+void get_index_path(uint16_t index, char *out);
 void get_addr_id_path(uint8_t addr[], uint16_t index, char *out);
+// creates the directories leading up to the file at path
+bool make_parent_dirs(const char *path);
+// fills indices with up to max_files indices of files in the node layout and returns the count
+// if indices is NULL, only counts the files
+uint16_t list_index_files(uint16_t *indices, uint16_t max_files);
 
+// UTC in us, from the PPS disciplined clock once it is valid, otherwise the system time
 uint64_t get_time(void);
+// get_time() at the esp_timer time local_us
+uint64_t get_time_at(int64_t local_us);
 
 esp_err_t espnow_add_peer(const uint8_t *peer_addr);
 // two separate functions for setting addr/sending data so that
@@ -42,17 +72,32 @@ void aux_activate(void);
 void aux_deactivate(void);
 
 extern const char *SD_MOUNT_POINT;
+// card mounted by sd_init
+extern sdmmc_card_t *sd_card;
 #define LEN_SYNC_PACKET 8
 extern const uint8_t SYNC_PACKET[LEN_SYNC_PACKET];
 
+// optionally appended by the node to its SYNC reply so that the collector
+// can tell whether anything changed since it last synced with the node
+typedef struct __attribute__((__packed__)) {
+  // incremented every time the node's catalog of files changes
+  uint32_t generation;
+  // sum of the sizes of all files on the node
+  uint32_t total_bytes;
+  uint16_t newest_index;
+  uint32_t newest_size;
+} sync_summary_t;
+
+#define LEN_SYNC_SUMMARY_PACKET (LEN_SYNC_PACKET + sizeof(sync_summary_t))
+
 typedef struct __attribute__((__packed__)) {
   uint16_t index;
   uint32_t size;
 } file_list_entry_t;
 
-// len("/sdcard/") + 12 hex chars for MAC + "-" str(file_index) + null
-// 8 + 12 + 1 + max 5 + 1
-static const uint8_t LEN_MAX_FNAME = 30;
+// len("/sdcard/") + 12 hex chars for MAC + "/B" + 2 hex chars for bucket + "/" + str(file_index) + null
+// 8 + 12 + 2 + 2 + 1 + max 5 + 1
+static const uint8_t LEN_MAX_FNAME = 31;
 
 extern uint16_t packet_send_count;
 extern uint16_t packet_fail_count;
@@ -0,0 +1,135 @@
+#include "common.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+
+// the file layout on the SD card. kept apart from common.cpp, which needs the rest of
+// ESP-IDF, so it can be built and tested on the host
+
+bool conv_strtoul(char *str, uint16_t *num) {
+  // only names made up entirely of digits are file indices
+  if (*str == '\0') return false;
+  for (char *c = str; *c != '\0'; c++) {
+    if (*c < '0' || *c > '9') return false;
+  }
+
+  errno = 0;
+  unsigned long val = strtoul(str, NULL, 10);
+  if (errno != 0 || val > UINT16_MAX) return false;
+
+  if (num != NULL) *num = val;
+
+  return true;
+}
+
+bool get_file_size(char *fname, uint32_t *size) {
+  const char *TAG = "get_file_size";
+
+  FILE *fp = fopen(fname, "r");
+
+  if (fp == NULL) {
+    return false;
+  }
+
+  if (fseeko(fp, 0, SEEK_END) != 0) {
+    ESP_LOGE(TAG, "fseek %s failed", fname);
+    return false;
+  }
+
+  *size = ftello(fp);
+  fclose(fp);
+
+  ESP_LOGI(TAG, "file=%s has size=%d", fname, *size);
+
+  return true;
+}
+
+bool get_file_size(uint16_t file_index, uint32_t *size) {
+  char fname[LEN_MAX_FNAME];
+  get_index_path(file_index, fname);
+
+  return get_file_size(fname, size);
+}
+
+bool get_file_size(uint8_t addr[], uint16_t file_index, uint32_t *size) {
+  char fname[LEN_MAX_FNAME];
+  get_addr_id_path(addr, file_index, fname);
+
+  return get_file_size(fname, size);
+}
+
+void get_index_path(uint16_t file_index, char *out) {
+  snprintf(out, LEN_MAX_FNAME, "%s/B%02X/%d", SD_MOUNT_POINT, file_index / FILES_PER_BUCKET, file_index);
+}
+
+void get_addr_id_path(uint8_t addr[], uint16_t file_index, char *out) {
+  snprintf(out, LEN_MAX_FNAME, "%s/%02X%02X%02X%02X%02X%02X/B%02X/%d", SD_MOUNT_POINT, ARG_MAC(addr), file_index / FILES_PER_BUCKET, file_index);
+}
+
+bool make_parent_dirs(const char *path) {
+  char dir[LEN_MAX_FNAME];
+  strncpy(dir, path, LEN_MAX_FNAME - 1);
+  dir[LEN_MAX_FNAME - 1] = '\0';
+
+  // skip the mount point, which always exists
+  for (char *p = dir + strlen(SD_MOUNT_POINT) + 1; *p != '\0'; p++) {
+    if (*p != '/') continue;
+
+    *p = '\0';
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+      ESP_LOGE("make_parent_dirs", "mkdir %s failed", dir);
+      return false;
+    }
+    *p = '/';
+  }
+
+  return true;
+}
+
+uint16_t list_index_files(uint16_t *indices, uint16_t max_files) {
+  const char *TAG = "list_index_files";
+
+  DIR *d = opendir(SD_MOUNT_POINT);
+  if (d == NULL) {
+    ESP_LOGW(TAG, "failed to open %s", SD_MOUNT_POINT);
+    return 0;
+  }
+
+  struct dirent *dir;
+  char bucket_path[LEN_MAX_FNAME];
+  uint16_t count = 0;
+
+  while ((dir = readdir(d)) != NULL && count < max_files) {
+    // buckets are B followed by two hex digits
+    if (dir->d_type != DT_DIR || dir->d_name[0] != 'B' || strlen(dir->d_name) != 3) continue;
+
+    snprintf(bucket_path, LEN_MAX_FNAME, "%s/%.3s", SD_MOUNT_POINT, dir->d_name);
+
+    DIR *bucket = opendir(bucket_path);
+    if (bucket == NULL) continue;
+
+    struct dirent *file;
+    while ((file = readdir(bucket)) != NULL && count < max_files) {
+      if (file->d_type != DT_REG) continue;
+
+      uint16_t index;
+      // index 0 is the file list, never a file on the card
+      if (!conv_strtoul(file->d_name, &index) || index == 0) continue;
+
+      if (indices != NULL) indices[count] = index;
+      count++;
+    }
+
+    closedir(bucket);
+  }
+
+  closedir(d);
+
+  return count;
+}
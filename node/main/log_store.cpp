@@ -0,0 +1,559 @@
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "sdmmc_cmd.h"
+#include "esp32/rom/crc.h"
+
+#include "log_store.h"
+
+static const char *TAG = "log_store";
+
+static const uint32_t SECTOR_SIZE = 512;
+static const uint8_t PARTITION_TYPE_LOG = 0xDA;
+static const uint32_t LOG_MAGIC = 0x474f4c53;
+static const uint32_t INDEX_MAGIC = 0x58444e49;
+// records in each group, sized so that the group's index fits into one sector
+static const uint32_t INDEX_INTERVAL = 48;
+
+// size of the buffers used to stage sectors to and from the card
+static const uint32_t BUF_SECTORS = (CONFIG_WRITE_BUF_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  // 0 for the first record in the partition, incremented for each record
+  uint32_t seq;
+  uint16_t file_index;
+  // offset of the payload in the virtual file
+  uint32_t file_offset;
+  uint32_t len;
+  uint32_t payload_crc = 0;
+  // crc of all fields above
+  uint32_t header_crc;
+} log_header_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint16_t file_index;
+  uint32_t file_offset;
+  uint32_t len;
+} log_index_entry_t;
+
+// the first sector of each group is reserved for its index, and written once the group's
+// INDEX_INTERVAL records have been appended. recovery reads one sector per complete group
+// and only walks the record headers of the last one
+typedef struct __attribute__((__packed__)) {
+  uint32_t magic;
+  // seq of the first record in the group
+  uint32_t first_seq;
+  log_index_entry_t entries[INDEX_INTERVAL];
+  // crc of all fields above
+  uint32_t crc;
+} log_index_t;
+
+static_assert(sizeof(log_index_t) <= SECTOR_SIZE, "log_index_t must fit into one sector");
+
+// in memory index of a record
+typedef struct {
+  uint16_t file_index;
+  uint32_t file_offset;
+  uint32_t len;
+  // sector of the record header
+  uint32_t lba;
+} log_record_t;
+
+static struct {
+  bool ready;
+
+  // partition in sectors
+  uint32_t start;
+  uint32_t num_sectors;
+  // next free sector, relative to start
+  uint32_t next;
+  uint32_t next_seq;
+  // index sector of the group the last record is in, relative to start
+  uint32_t group_start;
+  // file_index of the last record, which is the highest one in the log. kept when
+  // recovery fails, so files written instead do not reuse indices the log holds
+  uint16_t last_file_index;
+
+  // sorted by seq, which is also (file_index, file_offset) order
+  log_record_t *records;
+  uint32_t num_records;
+  uint32_t max_records;
+
+  uint8_t *write_buf;
+
+  uint8_t *read_buf;
+  // absolute sectors held in read_buf
+  uint32_t read_lba;
+  uint32_t read_count;
+
+  SemaphoreHandle_t lock;
+} local_state;
+
+static uint32_t num_sectors(uint32_t len) {
+  return (len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+static uint32_t header_crc(const log_header_t *header) {
+  return crc32_le(0, (const uint8_t *) header, offsetof(log_header_t, header_crc));
+}
+
+// finds the log partition in the MBR
+static bool find_partition(void) {
+  if (sdmmc_read_sectors(sd_card, local_state.read_buf, 0, 1) != ESP_OK) return false;
+
+  const uint8_t *mbr = local_state.read_buf;
+  if (mbr[510] != 0x55 || mbr[511] != 0xAA) return false;
+
+  for (uint8_t i = 0; i < 4; i++) {
+    const uint8_t *entry = mbr + 446 + i * 16;
+    if (entry[4] != PARTITION_TYPE_LOG) continue;
+
+    memcpy(&local_state.start, entry + 8, 4);
+    memcpy(&local_state.num_sectors, entry + 12, 4);
+    return local_state.num_sectors > 1;
+  }
+
+  return false;
+}
+
+static uint32_t index_crc(const log_index_t *index) {
+  return crc32_le(0, (const uint8_t *) index, offsetof(log_index_t, crc));
+}
+
+static bool add_record(uint16_t file_index, uint32_t file_offset, uint32_t len, uint32_t lba) {
+  if (local_state.num_records == local_state.max_records) {
+    uint32_t new_max = local_state.max_records == 0 ? 256 : local_state.max_records * 2;
+    log_record_t *records = (log_record_t *) heap_caps_realloc(local_state.records, new_max * sizeof(log_record_t), MALLOC_CAP_SPIRAM);
+    if (records == NULL) return false;
+
+    local_state.records = records;
+    local_state.max_records = new_max;
+  }
+
+  log_record_t *record = &local_state.records[local_state.num_records++];
+  record->file_index = file_index;
+  record->file_offset = file_offset;
+  record->len = len;
+  record->lba = lba;
+
+  local_state.last_file_index = file_index;
+
+  return true;
+}
+
+static bool check_payload(const log_record_t *record, uint32_t expected_crc) {
+  uint32_t crc = 0;
+  uint32_t remaining = record->len;
+  uint32_t lba = record->lba + 1;
+
+  while (remaining > 0) {
+    uint32_t count = num_sectors(remaining);
+    if (count > BUF_SECTORS) count = BUF_SECTORS;
+
+    if (sdmmc_read_sectors(sd_card, local_state.read_buf, lba, count) != ESP_OK) return false;
+
+    uint32_t len = count * SECTOR_SIZE;
+    if (len > remaining) len = remaining;
+
+    crc = crc32_le(crc, local_state.read_buf, len);
+    remaining -= len;
+    lba += count;
+  }
+
+  return crc == expected_crc;
+}
+
+// adds the records of the group at local_state.next from its index sector in read_buf
+// returns false if the index is not valid, the group is then the last one, or its index
+// could not be written. out_of_memory is set if the records did not fit into the table
+static bool recover_index(bool *out_of_memory) {
+  log_index_t index;
+  memcpy(&index, local_state.read_buf, sizeof(log_index_t));
+
+  if (index.magic != INDEX_MAGIC || index.first_seq != local_state.next_seq || index.crc != index_crc(&index)) return false;
+
+  uint32_t end = local_state.next + 1;
+  for (uint32_t i = 0; i < INDEX_INTERVAL; i++) {
+    end += 1 + num_sectors(index.entries[i].len);
+    if (end > local_state.num_sectors) return false;
+  }
+
+  uint32_t lba = local_state.start + local_state.next + 1;
+  for (uint32_t i = 0; i < INDEX_INTERVAL; i++) {
+    const log_index_entry_t *entry = &index.entries[i];
+
+    if (!add_record(entry->file_index, entry->file_offset, entry->len, lba)) {
+      *out_of_memory = true;
+      return false;
+    }
+    lba += 1 + num_sectors(entry->len);
+  }
+
+  local_state.group_start = local_state.next;
+  local_state.next = end;
+  local_state.next_seq += INDEX_INTERVAL;
+  return true;
+}
+
+// rebuilds the record table from the group indices, and the record headers of the last group
+// returns false if the end of the log could not be found, appending then could overwrite records
+static bool recover(void) {
+  log_header_t header;
+  log_header_t last_header;
+  // the last record was found through its header rather than a group index
+  bool last_walked = false;
+
+  while (local_state.next < local_state.num_sectors) {
+    uint32_t group_start = local_state.next;
+    uint32_t lba = local_state.start + group_start;
+    if (sdmmc_read_sectors(sd_card, local_state.read_buf, lba, 1) != ESP_OK) {
+      ESP_LOGE(TAG, "failed to read sector %d", lba);
+      return false;
+    }
+
+    bool out_of_memory = false;
+    if (recover_index(&out_of_memory)) {
+      last_walked = false;
+      continue;
+    }
+    if (out_of_memory) {
+      ESP_LOGE(TAG, "out of memory for record table");
+      return false;
+    }
+
+    // walk the record headers after the index sector
+    uint32_t next = group_start + 1;
+    uint32_t count = 0;
+
+    while (count < INDEX_INTERVAL && next < local_state.num_sectors) {
+      lba = local_state.start + next;
+      if (sdmmc_read_sectors(sd_card, local_state.read_buf, lba, 1) != ESP_OK) {
+        ESP_LOGE(TAG, "failed to read sector %d", lba);
+        return false;
+      }
+
+      memcpy(&header, local_state.read_buf, sizeof(log_header_t));
+
+      if (header.magic != LOG_MAGIC || header.seq != local_state.next_seq || header.header_crc != header_crc(&header)) break;
+
+      uint32_t record_sectors = 1 + num_sectors(header.len);
+      if (next + record_sectors > local_state.num_sectors) break;
+
+      if (!add_record(header.file_index, header.file_offset, header.len, lba)) {
+        ESP_LOGE(TAG, "out of memory for record table");
+        return false;
+      }
+
+      last_header = header;
+      next += record_sectors;
+      local_state.next_seq ++;
+      count ++;
+    }
+
+    // an empty group is the end of the log, its index sector is reserved again by the next append
+    if (count == 0) break;
+
+    local_state.group_start = group_start;
+    local_state.next = next;
+    last_walked = true;
+
+    if (count < INDEX_INTERVAL) break;
+    ESP_LOGW(TAG, "index of records %d to %d missing", local_state.next_seq - INDEX_INTERVAL, local_state.next_seq - 1);
+  }
+
+  if (last_walked) {
+    log_record_t *last = &local_state.records[local_state.num_records - 1];
+
+    if (!check_payload(last, last_header.payload_crc)) {
+      ESP_LOGW(TAG, "dropping record %d with bad payload", local_state.next_seq - 1);
+      local_state.next = last->lba - local_state.start;
+      local_state.next_seq --;
+      local_state.num_records --;
+
+      if (local_state.num_records % INDEX_INTERVAL == 0) local_state.next = local_state.group_start;
+    }
+  }
+
+  ESP_LOGI(TAG, "recovered %d records, %d of %d sectors used", local_state.num_records, local_state.next, local_state.num_sectors);
+  return true;
+}
+
+bool log_store_init(void) {
+  memset(&local_state, 0, sizeof(local_state));
+
+  local_state.write_buf = (uint8_t *) heap_caps_malloc(BUF_SECTORS * SECTOR_SIZE, MALLOC_CAP_DMA);
+  local_state.read_buf = (uint8_t *) heap_caps_malloc(BUF_SECTORS * SECTOR_SIZE, MALLOC_CAP_DMA);
+  local_state.lock = xSemaphoreCreateMutex();
+
+  if (local_state.write_buf == NULL || local_state.read_buf == NULL || local_state.lock == NULL) {
+    ESP_LOGE(TAG, "failed to allocate buffers");
+    return false;
+  }
+
+  if (!find_partition()) {
+    ESP_LOGW(TAG, "no log partition (type 0x%02x) found", PARTITION_TYPE_LOG);
+    return false;
+  }
+
+  ESP_LOGI(TAG, "log partition at sector %d, %d sectors", local_state.start, local_state.num_sectors);
+
+  if (!recover()) {
+    // leave the log untouched, samples go to files instead
+    ESP_LOGE(TAG, "log partition not usable this boot, it holds files up to %d", local_state.last_file_index);
+    heap_caps_free(local_state.records);
+    local_state.records = NULL;
+    local_state.num_records = 0;
+    local_state.max_records = 0;
+    return false;
+  }
+
+  local_state.ready = true;
+  return true;
+}
+
+bool log_store_ready(void) {
+  return local_state.ready;
+}
+
+uint16_t log_store_last_file_index(void) {
+  return local_state.last_file_index;
+}
+
+// writes len bytes gathered from the two parts into sectors starting at lba
+// the last sector is padded with whatever is left in write_buf
+static bool write_payload(uint32_t lba, const uint8_t *parts[2], const uint32_t part_lens[2], uint32_t len, uint32_t *crc) {
+  uint8_t part = 0;
+  uint32_t part_offset = 0;
+  uint32_t remaining = len;
+
+  while (remaining > 0) {
+    uint32_t count = num_sectors(remaining);
+    if (count > BUF_SECTORS) count = BUF_SECTORS;
+
+    uint32_t fill = count * SECTOR_SIZE;
+    if (fill > remaining) fill = remaining;
+
+    // gather from the parts into write_buf
+    for (uint32_t filled = 0; filled < fill; ) {
+      uint32_t n = part_lens[part] - part_offset;
+      if (n > fill - filled) n = fill - filled;
+
+      memcpy(local_state.write_buf + filled, parts[part] + part_offset, n);
+      filled += n;
+      part_offset += n;
+
+      if (part_offset == part_lens[part]) {
+        part ++;
+        part_offset = 0;
+      }
+    }
+
+    *crc = crc32_le(*crc, local_state.write_buf, fill);
+
+    if (sdmmc_write_sectors(sd_card, local_state.write_buf, lba, count) != ESP_OK) return false;
+
+    remaining -= fill;
+    lba += count;
+  }
+
+  return true;
+}
+
+// fills in the index sector of the group that the last record completed. if this fails the
+// group is recovered from its record headers instead
+static void write_index(void) {
+  log_index_t index;
+  index.magic = INDEX_MAGIC;
+  index.first_seq = local_state.next_seq - INDEX_INTERVAL;
+
+  const log_record_t *records = local_state.records + local_state.num_records - INDEX_INTERVAL;
+  for (uint32_t i = 0; i < INDEX_INTERVAL; i++) {
+    index.entries[i].file_index = records[i].file_index;
+    index.entries[i].file_offset = records[i].file_offset;
+    index.entries[i].len = records[i].len;
+  }
+
+  index.crc = index_crc(&index);
+
+  memset(local_state.write_buf, 0, SECTOR_SIZE);
+  memcpy(local_state.write_buf, &index, sizeof(log_index_t));
+  if (sdmmc_write_sectors(sd_card, local_state.write_buf, local_state.start + local_state.group_start, 1) != ESP_OK) {
+    ESP_LOGW(TAG, "failed to write index of records %d to %d", index.first_seq, local_state.next_seq - 1);
+  }
+}
+
+bool log_store_append(uint16_t file_index, const void *header, uint32_t header_len, const void *data, uint32_t data_len) {
+  if (!local_state.ready) return false;
+
+  uint32_t len = header_len + data_len;
+  uint32_t record_sectors = 1 + num_sectors(len);
+
+  xSemaphoreTake(local_state.lock, portMAX_DELAY);
+
+  // the first record of a group goes after the sector reserved for the group's index
+  bool new_group = local_state.num_records % INDEX_INTERVAL == 0;
+  uint32_t record_start = local_state.next + (new_group ? 1 : 0);
+
+  if (record_start + record_sectors > local_state.num_sectors) {
+    xSemaphoreGive(local_state.lock);
+    ESP_LOGW(TAG, "log partition full");
+    return false;
+  }
+
+  uint32_t lba = local_state.start + record_start;
+
+  log_header_t log_header;
+  log_header.magic = LOG_MAGIC;
+  log_header.seq = local_state.next_seq;
+  log_header.file_index = file_index;
+  log_header.file_offset = 0;
+  log_header.len = len;
+  log_header.payload_crc = 0;
+
+  if (local_state.num_records > 0) {
+    log_record_t *last = &local_state.records[local_state.num_records - 1];
+    if (last->file_index == file_index) log_header.file_offset = last->file_offset + last->len;
+  }
+
+  const uint8_t *parts[2] = { (const uint8_t *) header, (const uint8_t *) data };
+  const uint32_t part_lens[2] = { header_len, data_len };
+
+  // payload first, then the header which commits the record
+  uint32_t payload_crc = 0;
+  bool ok = write_payload(lba + 1, parts, part_lens, len, &payload_crc);
+
+  if (ok) {
+    log_header.payload_crc = payload_crc;
+    log_header.header_crc = header_crc(&log_header);
+
+    memset(local_state.write_buf, 0, SECTOR_SIZE);
+    memcpy(local_state.write_buf, &log_header, sizeof(log_header_t));
+    ok = sdmmc_write_sectors(sd_card, local_state.write_buf, lba, 1) == ESP_OK;
+  }
+
+  if (ok) ok = add_record(log_header.file_index, log_header.file_offset, log_header.len, lba);
+
+  if (ok) {
+    if (new_group) local_state.group_start = local_state.next;
+    local_state.next = record_start + record_sectors;
+    local_state.next_seq ++;
+
+    if (local_state.num_records % INDEX_INTERVAL == 0) write_index();
+  } else {
+    ESP_LOGE(TAG, "failed to append record %d", log_header.seq);
+  }
+
+  xSemaphoreGive(local_state.lock);
+
+  return ok;
+}
+
+// returns the first record of file_index whose end is after file_offset, or num_records if none
+static uint32_t find_record(uint16_t file_index, uint32_t file_offset) {
+  uint32_t lo = 0;
+  uint32_t hi = local_state.num_records;
+
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    const log_record_t *record = &local_state.records[mid];
+
+    if (record->file_index < file_index || (record->file_index == file_index && record->file_offset + record->len <= file_offset)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+bool log_store_has_file(uint16_t file_index) {
+  if (!local_state.ready) return false;
+
+  xSemaphoreTake(local_state.lock, portMAX_DELAY);
+  uint32_t i = find_record(file_index, 0);
+  bool found = i < local_state.num_records && local_state.records[i].file_index == file_index;
+  xSemaphoreGive(local_state.lock);
+
+  return found;
+}
+
+uint16_t log_store_count_files(uint32_t *total_bytes) {
+  return log_store_list_files(NULL, UINT16_MAX, total_bytes);
+}
+
+uint16_t log_store_list_files(file_list_entry_t entries[], uint16_t max_files, uint32_t *total_bytes) {
+  if (total_bytes != NULL) *total_bytes = 0;
+  if (!local_state.ready) return 0;
+
+  uint16_t count = 0;
+
+  xSemaphoreTake(local_state.lock, portMAX_DELAY);
+  for (uint32_t i = 0; i < local_state.num_records; i++) {
+    const log_record_t *record = &local_state.records[i];
+    if (total_bytes != NULL) *total_bytes += record->len;
+
+    // the last record of each file gives its size
+    if (i + 1 < local_state.num_records && local_state.records[i + 1].file_index == record->file_index) continue;
+    if (count == max_files) continue;
+
+    if (entries != NULL) {
+      entries[count].index = record->file_index;
+      entries[count].size = record->file_offset + record->len;
+    }
+    count ++;
+  }
+  xSemaphoreGive(local_state.lock);
+
+  return count;
+}
+
+bool log_store_read(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br) {
+  *br = 0;
+
+  xSemaphoreTake(local_state.lock, portMAX_DELAY);
+
+  while (*br < btr) {
+    uint32_t i = find_record(file_index, file_offset);
+    if (i == local_state.num_records || local_state.records[i].file_index != file_index) break;
+
+    const log_record_t *record = &local_state.records[i];
+    uint32_t record_offset = file_offset - record->file_offset;
+
+    // read the sectors holding record_offset into read_buf unless they are already there
+    uint32_t lba = record->lba + 1 + record_offset / SECTOR_SIZE;
+    uint32_t last_lba = record->lba + num_sectors(record->len);
+
+    if (lba < local_state.read_lba || lba >= local_state.read_lba + local_state.read_count) {
+      uint32_t count = last_lba - lba + 1;
+      if (count > BUF_SECTORS) count = BUF_SECTORS;
+
+      if (sdmmc_read_sectors(sd_card, local_state.read_buf, lba, count) != ESP_OK) {
+        ESP_LOGE(TAG, "failed to read sector %d", lba);
+        local_state.read_count = 0;
+        xSemaphoreGive(local_state.lock);
+        return false;
+      }
+
+      local_state.read_lba = lba;
+      local_state.read_count = count;
+    }
+
+    uint32_t buf_offset = (lba - local_state.read_lba) * SECTOR_SIZE + record_offset % SECTOR_SIZE;
+    uint32_t n = local_state.read_count * SECTOR_SIZE - buf_offset;
+    if (n > record->len - record_offset) n = record->len - record_offset;
+    if (n > (uint32_t) (btr - *br)) n = btr - *br;
+
+    memcpy(data + *br, local_state.read_buf + buf_offset, n);
+    *br += n;
+    file_offset += n;
+  }
+
+  xSemaphoreGive(local_state.lock);
+
+  return true;
+}
@@ -0,0 +1,41 @@
+#ifndef LOG_STORE_H
+#define LOG_STORE_H
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+  append-only log of chunks in a reserved partition of the SD card (MBR
+  partition type 0xDA), written with raw sector writes instead of through FAT
+
+  each record is a header sector followed by its payload sectors. the payload is
+  written before the header, so a record only becomes valid once its header
+  (with sequence number and CRCs) is on the card. records are appended in groups,
+  each starting with an index sector that is written once the group is complete.
+  log_store_init reads the group indices and the headers of the last group to
+  rebuild the record table, and only checks the payload CRC of the last record
+  because earlier records were complete before it was started
+
+  records are exposed as virtual files: all records with the same file_index
+  form one file, read through log_store_read like a file on the FAT partition
+*/
+
+// returns false if there is no log partition on the card
+bool log_store_init(void);
+// true if log_store_init found a log partition
+bool log_store_ready(void);
+// highest file_index in the log, also when it could not be recovered and is not ready
+uint16_t log_store_last_file_index(void);
+
+// appends a record of (header, data) to file_index, returns false if the log is full
+bool log_store_append(uint16_t file_index, const void *header, uint32_t header_len, const void *data, uint32_t data_len);
+
+bool log_store_has_file(uint16_t file_index);
+// number of virtual files, and total number of bytes in them
+uint16_t log_store_count_files(uint32_t *total_bytes);
+// fills entries (if not NULL) with up to max_files virtual files and returns the count
+uint16_t log_store_list_files(file_list_entry_t entries[], uint16_t max_files, uint32_t *total_bytes);
+
+bool log_store_read(uint16_t file_index, uint32_t file_offset, uint8_t *data, uint16_t btr, uint16_t *br);
+
+#endif
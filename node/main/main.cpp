@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <dirent.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_now.h"
@@ -9,6 +10,8 @@
 #include "time_sync_task.h"
 #include "sample_task.h"
 #include "monitor_task.h"
+#include "log_store.h"
+#include "power.h"
 
 #include "sdkconfig.h"
 
@@ -18,14 +21,50 @@ extern "C" {
   void app_main();
 }
 
+// moves files written before the sharded layout from the root of the SD card into their bucket
+static void migrate_files(void) {
+  DIR *d = opendir(SD_MOUNT_POINT);
+  if (d == NULL) return;
+
+  struct dirent *dir;
+  char old_fname[LEN_MAX_FNAME];
+  char new_fname[LEN_MAX_FNAME];
+
+  while ((dir = readdir(d)) != NULL) {
+    if (dir->d_type != DT_REG) continue;
+
+    uint16_t index;
+    if (!conv_strtoul(dir->d_name, &index) || index == 0) continue;
+
+    snprintf(old_fname, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, dir->d_name);
+    get_index_path(index, new_fname);
+
+    if (make_parent_dirs(new_fname) && rename(old_fname, new_fname) == 0) {
+      ESP_LOGI(TAG, "moved %s to %s", old_fname, new_fname);
+    } else {
+      ESP_LOGW(TAG, "failed to move %s to %s", old_fname, new_fname);
+    }
+  }
+
+  closedir(d);
+}
+
 void app_main(void) {
   hw_init();
+  power_init();
 
   nvs_init();
   wifi_init();
   espnow_init();
 
   sd_init();
+  migrate_files();
+
+  #ifdef CONFIG_LOG_STORE
+    if (!log_store_init()) {
+      ESP_LOGW(TAG, "no log partition found, samples will be written to files");
+    }
+  #endif
 
   xTaskCreate(monitor_task, "monitor_task", 2048, NULL, 3, NULL);
   xTaskCreate(mtftp_task, "mtftp_task", 8192, NULL, 4, NULL);
@@ -2,6 +2,7 @@
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "common.h"
+#include "power.h"
 
 #include "monitor_task.h"
 
@@ -18,9 +19,15 @@ const uint32_t led_blink[][2] = {
 
 uint8_t blink_index = 0;
 
+// longest time between checks of the button
+static const int64_t BTN_POLL_INTERVAL = 100000;
+
 void monitor_task(void *pvParameter) {
   uint64_t btn_press_time = 0;
   bool has_time_sync = false;
+  #ifdef CONFIG_NODE_POWER_SAVE
+    int64_t last_stats_time = esp_timer_get_time();
+  #endif
 
   while(1) {
     if (get_btn_user() == 0) {
@@ -35,8 +42,21 @@ void monitor_task(void *pvParameter) {
       btn_press_time = 0;
     }
 
+    int64_t time = esp_timer_get_time();
+    int64_t phase = time % led_blink[blink_index][1];
+    bool led_on = phase < led_blink[blink_index][0];
+
+    set_led(led_on);
+
+    // sleep until the led has to change, instead of polling it
+    int64_t wait = led_on ? led_blink[blink_index][0] - phase : led_blink[blink_index][1] - phase;
+    if (wait > BTN_POLL_INTERVAL) wait = BTN_POLL_INTERVAL;
+
+    TickType_t wait_ticks = wait / 1000 / portTICK_PERIOD_MS;
+    if (wait_ticks == 0) wait_ticks = 1;
+
     uint8_t evt;
-    if (xQueueReceive(evt_queue, &evt, 50 / portTICK_PERIOD_MS) == pdTRUE) {
+    if (xQueueReceive(evt_queue, &evt, wait_ticks) == pdTRUE) {
       if (evt == EVT_TIME_SYNCED) {
         blink_index = 1;
         has_time_sync = true;
@@ -53,12 +73,11 @@ void monitor_task(void *pvParameter) {
       }
     }
 
-    int64_t time = esp_timer_get_time();
-
-    if ((time % led_blink[blink_index][1]) < led_blink[blink_index][0]) {
-      set_led(1);
-    } else {
-      set_led(0);
-    }
+    #ifdef CONFIG_NODE_POWER_SAVE
+      if (time - last_stats_time > (int64_t) CONFIG_POWER_STATS_INTERVAL * 1000000) {
+        power_log_stats();
+        last_stats_time = time;
+      }
+    #endif
   }
 }
@@ -1,6 +1,5 @@
 #include <stdio.h>
 #include <string.h>
-#include <dirent.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/ringbuf.h"
@@ -11,6 +10,9 @@
 #include "mtftp_server.hpp"
 #include "sample_task.h"
 #include "monitor_task.h"
+#include "log_store.h"
+#include "power.h"
+#include "clock.h"
 
 #include "mtftp_task.h"
 #include "common.h"
@@ -21,6 +23,7 @@
 static const uint32_t REPORT_INTERVAL = 1000;
 
 static MtftpServer server;
+static TaskHandle_t mtftp_task_handle;
 
 enum state {
   STATE_WAIT_PEER,
@@ -40,42 +43,24 @@ struct {
 } local_state;
 
 static uint16_t countFiles(void) {
-  const char *TAG = "countFiles";
-
-  DIR *d = opendir(SD_MOUNT_POINT);
-
-  if (d == NULL) return 0;
-
-  struct dirent *dir;
-  uint16_t count = 0;
-
-  while ((dir = readdir(d)) != NULL) {
-    ESP_LOGD(TAG, "file=%s, type=%d", dir->d_name, dir->d_type);
-
-    if (!conv_strtoul(dir->d_name, NULL)) continue;
-
-    if (dir->d_type == DT_REG) count++;
-  }
-
-  closedir(d);
-
-  return count;
+  #ifdef CONFIG_LOG_STORE
+    return list_index_files(NULL, UINT16_MAX) + log_store_count_files(NULL);
+  #else
+    return list_index_files(NULL, UINT16_MAX);
+  #endif
 }
 
-static uint16_t buildFileList(file_list_entry_t entries[]) {
+static uint16_t buildFileList(file_list_entry_t entries[], uint16_t max_files) {
   const char *TAG = "buildFileList";
 
-  DIR *d = opendir(SD_MOUNT_POINT);
-
-  if (d == NULL) return 0;
+  uint16_t *indices = (uint16_t *) malloc(max_files * sizeof(uint16_t));
+  if (indices == NULL) return 0;
 
-  struct dirent *dir;
+  uint16_t num_files = list_index_files(indices, max_files);
   uint16_t count = 0;
 
-  while ((dir = readdir(d)) != NULL) {
-    if (dir->d_type != DT_REG) continue;
-
-    if (!conv_strtoul(dir->d_name, &(entries[count].index))) continue;
+  for (uint16_t i = 0; i < num_files; i++) {
+    entries[count].index = indices[i];
 
     if (entries[count].index == sample_file_index) {
       xSemaphoreTake(sample_file_semaph, portMAX_DELAY);
@@ -92,11 +77,15 @@ static uint16_t buildFileList(file_list_entry_t entries[]) {
       xSemaphoreGive(sample_file_semaph);
     }
 
-    ESP_LOGD(TAG, "filename=%s size=%d", dir->d_name, entries[count].size);
+    ESP_LOGD(TAG, "file_index=%d size=%d", entries[count].index, entries[count].size);
     count++;
   }
 
-  closedir(d);
+  free(indices);
+
+  #ifdef CONFIG_LOG_STORE
+    count += log_store_list_files(entries + count, max_files - count, NULL);
+  #endif
 
   return count;
 }
@@ -120,7 +109,7 @@ static bool readFileList(uint32_t file_offset, uint8_t *data, uint16_t btr, uint
       return false;
     }
 
-    if (num_files != buildFileList(local_state.file_list)) {
+    if (num_files != buildFileList(local_state.file_list, num_files)) {
       ESP_LOGW(TAG, "buildFileList got different number of files from countFiles!");
     }
   }
@@ -148,6 +137,12 @@ static bool readFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, u
     return readFileList(file_offset, data, btr, br);
   }
 
+  #ifdef CONFIG_LOG_STORE
+    if (log_store_has_file(file_index)) {
+      return log_store_read(file_index, file_offset, data, btr, br);
+    }
+  #endif
+
   if (local_state.file_index != file_index) {
     if (local_state.file_index != 0) {
       ESP_LOGI(TAG, "fclose %d", local_state.file_index);
@@ -163,8 +158,7 @@ static bool readFile(uint16_t file_index, uint32_t file_offset, uint8_t *data, u
     }
 
     char fname[LEN_MAX_FNAME];
-
-    snprintf(fname, LEN_MAX_FNAME, "%s/%d", SD_MOUNT_POINT, file_index);
+    get_index_path(file_index, fname);
 
     local_state.fp = fopen(fname, "r");
     if (local_state.fp == NULL) {
@@ -209,9 +203,30 @@ static void onRecvEspNowCb(const uint8_t *mac_addr, const uint8_t *data, int len
 
       // send back the same SYNC packet to the collector as ACK
       memcpy(local_state.peer_addr, mac_addr, 6);
-      sendEspNow(data, len);
 
-      local_state.state = STATE_ACTIVE;
+      #ifdef CONFIG_SYNC_SUMMARY
+        // append a summary of the files available so the collector can skip
+        // this node if nothing changed since it last synced
+        // before the files have been scanned there is no summary, and the collector always syncs
+        uint8_t reply[LEN_SYNC_SUMMARY_PACKET];
+        memcpy(reply, SYNC_PACKET, LEN_SYNC_PACKET);
+
+        sync_summary_t summary;
+        if (get_sync_summary(&summary)) {
+          memcpy(reply + LEN_SYNC_PACKET, &summary, sizeof(sync_summary_t));
+          sendEspNow(reply, LEN_SYNC_SUMMARY_PACKET);
+        } else {
+          sendEspNow(reply, LEN_SYNC_PACKET);
+        }
+      #else
+        sendEspNow(data, len);
+      #endif
+
+      if (local_state.state != STATE_ACTIVE) {
+        power_acquire(POWER_LOCK_RADIO);
+        local_state.state = STATE_ACTIVE;
+        xTaskNotifyGive(mtftp_task_handle);
+      }
 
       local_state.time_last_packet = esp_timer_get_time();
       received_non_sync = false;
@@ -243,6 +258,10 @@ static void endPeered(void) {
   ESP_LOGI(TAG, "ending peered communication");
 
   memset(local_state.peer_addr, 0, 6);
+
+  if (local_state.state == STATE_ACTIVE) {
+    power_release(POWER_LOCK_RADIO);
+  }
   local_state.state = STATE_WAIT_PEER;
 
   if (local_state.file_index != 0) {
@@ -257,6 +276,53 @@ static void endPeered(void) {
   }
 }
 
+#ifdef CONFIG_RENDEZVOUS
+  // a window as long as the period would keep the radio on for good, without saving anything
+  static_assert(CONFIG_RENDEZVOUS_WINDOW < CONFIG_RENDEZVOUS_PERIOD, "RENDEZVOUS_WINDOW must be shorter than RENDEZVOUS_PERIOD");
+
+  static bool radio_on = true;
+
+  static void set_radio(bool on) {
+    const char *TAG = "rendezvous";
+    if (on == radio_on) return;
+
+    if (on) {
+      power_acquire(POWER_LOCK_LISTEN);
+      wifi_resume();
+    } else {
+      wifi_suspend();
+      power_release(POWER_LOCK_LISTEN);
+    }
+
+    radio_on = on;
+    ESP_LOGD(TAG, "radio %s", on ? "on" : "off");
+  }
+
+  // turns the radio on inside a rendezvous window and off outside of one
+  // returns the number of ticks until the radio next has to change
+  static TickType_t rendezvous_update(void) {
+    // until the time is known the windows cannot be found, so keep listening
+    // and check again in a second
+    if (!clock_valid()) return pdMS_TO_TICKS(1000);
+
+    const int64_t period = (int64_t) CONFIG_RENDEZVOUS_PERIOD * 1000000;
+    const int64_t window = (int64_t) CONFIG_RENDEZVOUS_WINDOW * 1000000;
+
+    // windows start on multiples of the period since the epoch, so all nodes share them
+    int64_t phase = clock_now() % period;
+    bool in_window = phase < window;
+
+    set_radio(in_window);
+
+    int64_t wait = in_window ? window - phase : period - phase;
+    return wait / 1000 / portTICK_PERIOD_MS + 1;
+  }
+#else
+  static TickType_t rendezvous_update(void) {
+    return portMAX_DELAY;
+  }
+#endif
+
 static void rate_logging_task(void *pvParameter) {
   const char *TAG = "transfer";
 
@@ -273,6 +339,10 @@ static void rate_logging_task(void *pvParameter) {
 void mtftp_task(void *pvParameter) {
   const char *TAG = "mtftp_task";
   memset(&local_state, 0, sizeof(local_state));
+  mtftp_task_handle = xTaskGetCurrentTaskHandle();
+
+  // SYNCs from the collector can arrive at any time
+  power_acquire(POWER_LOCK_LISTEN);
 
   setEspNowTxAddr(local_state.peer_addr);
   esp_now_register_recv_cb(onRecvEspNowCb);
@@ -283,6 +353,12 @@ void mtftp_task(void *pvParameter) {
   server.setOnTimeoutCb(&endPeered);
 
   while(1) {
+    if (local_state.state == STATE_WAIT_PEER) {
+      // nothing to do until onRecvEspNowCb receives a SYNC, or the radio has
+      // to be switched at the edge of a rendezvous window
+      ulTaskNotifyTake(pdTRUE, rendezvous_update());
+    }
+
     server.loop();
     if (server.isIdle()) {
       if (local_state.state == STATE_ACTIVE && (esp_timer_get_time() - local_state.time_last_packet) > CONFIG_TIMEOUT) {
@@ -0,0 +1,281 @@
+#include <string.h>
+
+#include "nmea.h"
+
+enum {
+  STATE_WAIT_START = 0,
+  STATE_FIELDS,
+  STATE_CHECKSUM_HI,
+  STATE_CHECKSUM_LO
+};
+
+// longest sentence allowed by NMEA 0183, from $ up to the checksum
+static const uint8_t MAX_SENTENCE_LEN = 82;
+// fraction digits past this are ignored, so the mantissa cannot overflow
+static const int8_t MAX_FRAC_DIGITS = 9;
+
+static const uint64_t POW10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+// value of the current field with exactly digits fraction digits
+static uint64_t field_scaled(const nmea_parser_t *parser, int8_t digits) {
+  int8_t frac = parser->frac_digits < 0 ? 0 : parser->frac_digits;
+
+  if (frac < digits) return parser->mantissa * POW10[digits - frac];
+  return parser->mantissa / POW10[frac - digits];
+}
+
+// ddmm.mmmm or dddmm.mmmm to 1e-7 degrees
+static int32_t field_degrees(const nmea_parser_t *parser) {
+  // minutes with 7 fraction digits
+  uint64_t scaled = field_scaled(parser, 7);
+  uint64_t degrees = scaled / (100 * POW10[7]);
+  uint64_t minutes = scaled % (100 * POW10[7]);
+
+  return degrees * POW10[7] + minutes / 60;
+}
+
+// hhmmss.sss to ms since midnight
+static uint32_t field_time(const nmea_parser_t *parser) {
+  uint64_t scaled = field_scaled(parser, 3);
+  uint32_t hms = scaled / 1000;
+
+  return ((hms / 10000 * 60 + (hms / 100) % 100) * 60 + hms % 100) * 1000 + scaled % 1000;
+}
+
+static void reset_field(nmea_parser_t *parser) {
+  parser->mantissa = 0;
+  parser->frac_digits = -1;
+  parser->has_digits = false;
+  parser->negative = false;
+  parser->first_char = '\0';
+}
+
+static void end_address(nmea_parser_t *parser) {
+  nmea_sentence_t *s = &parser->sentence;
+
+  if (memcmp(parser->address, "ZDA", 3) == 0) {
+    s->type = NMEA_ZDA;
+  } else if (memcmp(parser->address, "RMC", 3) == 0) {
+    s->type = NMEA_RMC;
+  } else if (memcmp(parser->address, "GGA", 3) == 0) {
+    s->type = NMEA_GGA;
+  } else {
+    // not interested, skip to the next sentence
+    parser->state = STATE_WAIT_START;
+  }
+}
+
+static void end_zda_field(nmea_parser_t *parser) {
+  nmea_sentence_t *s = &parser->sentence;
+  if (!parser->has_digits) return;
+
+  switch (parser->field_index) {
+    case 1:
+      s->time_ms = field_time(parser);
+      s->has_time = true;
+      break;
+    case 2:
+      s->day = field_scaled(parser, 0);
+      break;
+    case 3:
+      s->month = field_scaled(parser, 0);
+      break;
+    case 4:
+      s->year = field_scaled(parser, 0);
+      s->has_date = s->day != 0 && s->month != 0;
+      break;
+  }
+}
+
+static void end_rmc_field(nmea_parser_t *parser) {
+  nmea_sentence_t *s = &parser->sentence;
+
+  switch (parser->field_index) {
+    case 1:
+      if (parser->has_digits) {
+        s->time_ms = field_time(parser);
+        s->has_time = true;
+      }
+      break;
+    case 2:
+      s->fix_valid = parser->first_char == 'A';
+      break;
+    case 3:
+      s->lat = field_degrees(parser);
+      s->has_position = parser->has_digits;
+      break;
+    case 4:
+      if (parser->first_char == 'S') s->lat = -s->lat;
+      break;
+    case 5:
+      s->lon = field_degrees(parser);
+      s->has_position &= parser->has_digits;
+      break;
+    case 6:
+      if (parser->first_char == 'W') s->lon = -s->lon;
+      break;
+    case 9:
+      if (parser->has_digits) {
+        // ddmmyy
+        uint32_t date = field_scaled(parser, 0);
+        s->day = date / 10000;
+        s->month = (date / 100) % 100;
+        s->year = 2000 + date % 100;
+        s->has_date = true;
+      }
+      break;
+  }
+}
+
+static void end_gga_field(nmea_parser_t *parser) {
+  nmea_sentence_t *s = &parser->sentence;
+
+  switch (parser->field_index) {
+    case 1:
+      if (parser->has_digits) {
+        s->time_ms = field_time(parser);
+        s->has_time = true;
+      }
+      break;
+    case 2:
+      s->lat = field_degrees(parser);
+      s->has_position = parser->has_digits;
+      break;
+    case 3:
+      if (parser->first_char == 'S') s->lat = -s->lat;
+      break;
+    case 4:
+      s->lon = field_degrees(parser);
+      s->has_position &= parser->has_digits;
+      break;
+    case 5:
+      if (parser->first_char == 'W') s->lon = -s->lon;
+      break;
+    case 6:
+      s->fix_valid = parser->has_digits && parser->mantissa != 0;
+      break;
+    case 7:
+      s->num_sats = field_scaled(parser, 0);
+      break;
+    case 9:
+      if (parser->has_digits) {
+        int32_t mm = field_scaled(parser, 3);
+        s->altitude_mm = parser->negative ? -mm : mm;
+        s->has_altitude = true;
+      }
+      break;
+  }
+}
+
+static void end_field(nmea_parser_t *parser) {
+  if (parser->field_index == 0) {
+    end_address(parser);
+  } else if (parser->sentence.type == NMEA_ZDA) {
+    end_zda_field(parser);
+  } else if (parser->sentence.type == NMEA_RMC) {
+    end_rmc_field(parser);
+  } else if (parser->sentence.type == NMEA_GGA) {
+    end_gga_field(parser);
+  }
+
+  parser->field_index ++;
+  reset_field(parser);
+}
+
+static int8_t hex_value(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+static void start_sentence(nmea_parser_t *parser) {
+  parser->state = STATE_FIELDS;
+  parser->len = 1;
+  parser->checksum = 0;
+  parser->field_index = 0;
+  memset(parser->address, 0, sizeof(parser->address));
+  memset(&parser->sentence, 0, sizeof(nmea_sentence_t));
+  reset_field(parser);
+}
+
+void nmea_init(nmea_parser_t *parser) {
+  memset(parser, 0, sizeof(nmea_parser_t));
+  parser->state = STATE_WAIT_START;
+}
+
+bool nmea_feed(nmea_parser_t *parser, uint8_t c, nmea_sentence_t *out) {
+  // a $ always starts a new sentence, even in the middle of one that was cut off
+  if (c == '$') {
+    start_sentence(parser);
+    return false;
+  }
+
+  switch (parser->state) {
+    case STATE_WAIT_START:
+      return false;
+
+    case STATE_FIELDS:
+      if (c < 0x20 || c > 0x7E || ++parser->len > MAX_SENTENCE_LEN) {
+        parser->state = STATE_WAIT_START;
+        return false;
+      }
+
+      if (c == '*') {
+        end_field(parser);
+        // end_field drops unknown sentences at the end of the address
+        if (parser->state == STATE_FIELDS) parser->state = STATE_CHECKSUM_HI;
+        return false;
+      }
+
+      parser->checksum ^= c;
+
+      if (c == ',') {
+        end_field(parser);
+      } else if (parser->field_index == 0) {
+        parser->address[0] = parser->address[1];
+        parser->address[1] = parser->address[2];
+        parser->address[2] = c;
+      } else {
+        if (parser->first_char == '\0') parser->first_char = c;
+
+        if (c >= '0' && c <= '9') {
+          if (parser->frac_digits < MAX_FRAC_DIGITS) {
+            parser->mantissa = parser->mantissa * 10 + (c - '0');
+            if (parser->frac_digits >= 0) parser->frac_digits ++;
+          }
+          parser->has_digits = true;
+        } else if (c == '.') {
+          parser->frac_digits = 0;
+        } else if (c == '-') {
+          parser->negative = true;
+        }
+      }
+      return false;
+
+    case STATE_CHECKSUM_HI:
+    {
+      int8_t v = hex_value(c);
+      if (v < 0) {
+        parser->state = STATE_WAIT_START;
+        return false;
+      }
+
+      parser->expected_checksum = v << 4;
+      parser->state = STATE_CHECKSUM_LO;
+      return false;
+    }
+
+    case STATE_CHECKSUM_LO:
+    {
+      int8_t v = hex_value(c);
+      parser->state = STATE_WAIT_START;
+      if (v < 0 || (parser->expected_checksum | v) != parser->checksum) return false;
+
+      *out = parser->sentence;
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,77 @@
+#ifndef NMEA_H
+#define NMEA_H
+
+#include <stdint.h>
+
+/*
+  incremental NMEA 0183 parser
+
+  bytes are fed one at a time straight from the UART, without buffering lines.
+  each field is decoded as it arrives into the sentence being built, and the
+  sentence is only handed out once its checksum has been verified. ZDA, RMC
+  and GGA from any talker are decoded, other sentences and anything that is
+  not NMEA (such as UBX frames) are skipped
+*/
+
+typedef enum {
+  NMEA_UNKNOWN = 0,
+  NMEA_ZDA,
+  NMEA_RMC,
+  NMEA_GGA
+} nmea_type_t;
+
+typedef struct {
+  nmea_type_t type;
+
+  // UTC time of day (ms), all three sentences
+  bool has_time;
+  uint32_t time_ms;
+
+  // UTC date, ZDA and RMC
+  bool has_date;
+  uint16_t year;
+  uint8_t month;
+  uint8_t day;
+
+  // position in 1e-7 degrees, RMC and GGA
+  bool has_position;
+  int32_t lat;
+  int32_t lon;
+
+  // RMC status is A, or GGA fix quality is not 0
+  bool fix_valid;
+
+  // GGA only
+  uint8_t num_sats;
+  bool has_altitude;
+  // above mean sea level (mm)
+  int32_t altitude_mm;
+} nmea_sentence_t;
+
+typedef struct {
+  uint8_t state;
+  // length of the sentence so far, sentences over 82 characters are dropped
+  uint8_t len;
+  uint8_t checksum;
+  uint8_t expected_checksum;
+
+  uint8_t field_index;
+  // value of the current field: its digits without the decimal point, and how many
+  // of them came after it. first_char is for single character fields
+  uint64_t mantissa;
+  int8_t frac_digits;
+  bool has_digits;
+  bool negative;
+  char first_char;
+  // last three characters of the address field, which give the sentence type
+  char address[3];
+
+  nmea_sentence_t sentence;
+} nmea_parser_t;
+
+void nmea_init(nmea_parser_t *parser);
+
+// feeds one byte, returns true if it completed a valid ZDA, RMC or GGA sentence, which is copied to out
+bool nmea_feed(nmea_parser_t *parser, uint8_t c, nmea_sentence_t *out);
+
+#endif
@@ -0,0 +1,144 @@
+#include "freertos/FreeRTOS.h"
+#include "esp_pm.h"
+#include "esp32/pm.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "power.h"
+
+#include "sdkconfig.h"
+
+static const char *TAG = "power";
+
+#ifdef CONFIG_NODE_POWER_SAVE
+
+typedef struct {
+  const char *name;
+  esp_pm_lock_type_t type;
+} lock_config_t;
+
+static const lock_config_t LOCK_CONFIGS[NUM_POWER_LOCKS] = {
+  {"spi", ESP_PM_CPU_FREQ_MAX},
+  {"sd", ESP_PM_CPU_FREQ_MAX},
+  {"radio", ESP_PM_CPU_FREQ_MAX},
+  {"listen", ESP_PM_NO_LIGHT_SLEEP},
+  {"gps", ESP_PM_APB_FREQ_MAX}
+};
+
+static struct {
+  esp_pm_lock_handle_t handle;
+  uint16_t count;
+  int64_t acquired_at;
+  int64_t held_us;
+} locks[NUM_POWER_LOCKS];
+
+// number of locks with count > 0, and the time since which none has been held
+static uint8_t num_held = 0;
+static int64_t released_at = 0;
+static int64_t unlocked_us = 0;
+
+static int64_t stats_start = 0;
+static portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void power_init(void) {
+  esp_pm_config_esp32_t pm_config;
+  pm_config.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+  pm_config.min_freq_mhz = 40;
+  pm_config.light_sleep_enable = true;
+
+  ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+
+  for (uint8_t i = 0; i < NUM_POWER_LOCKS; i++) {
+    ESP_ERROR_CHECK(esp_pm_lock_create(LOCK_CONFIGS[i].type, 0, LOCK_CONFIGS[i].name, &locks[i].handle));
+  }
+
+  stats_start = esp_timer_get_time();
+  released_at = stats_start;
+
+  ESP_LOGI(TAG, "power management enabled, %d-%dMHz with light sleep", pm_config.min_freq_mhz, pm_config.max_freq_mhz);
+}
+
+void power_acquire(power_lock_t lock) {
+  esp_pm_lock_acquire(locks[lock].handle);
+
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&stats_mux);
+  if (locks[lock].count++ == 0) {
+    locks[lock].acquired_at = now;
+
+    if (num_held++ == 0) {
+      unlocked_us += now - released_at;
+    }
+  }
+  portEXIT_CRITICAL(&stats_mux);
+}
+
+void power_release(power_lock_t lock) {
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL(&stats_mux);
+  if (locks[lock].count > 0 && --locks[lock].count == 0) {
+    locks[lock].held_us += now - locks[lock].acquired_at;
+
+    if (--num_held == 0) {
+      released_at = now;
+    }
+  }
+  portEXIT_CRITICAL(&stats_mux);
+
+  esp_pm_lock_release(locks[lock].handle);
+}
+
+void power_log_stats(void) {
+  int64_t held_us[NUM_POWER_LOCKS];
+  int64_t now = esp_timer_get_time();
+
+  // fold the time of locks that are currently held into the stats, and restart them
+  portENTER_CRITICAL(&stats_mux);
+  int64_t elapsed = now - stats_start;
+
+  for (uint8_t i = 0; i < NUM_POWER_LOCKS; i++) {
+    if (locks[i].count > 0) {
+      locks[i].held_us += now - locks[i].acquired_at;
+      locks[i].acquired_at = now;
+    }
+
+    held_us[i] = locks[i].held_us;
+    locks[i].held_us = 0;
+  }
+
+  if (num_held == 0) {
+    unlocked_us += now - released_at;
+    released_at = now;
+  }
+
+  int64_t idle_us = unlocked_us;
+  unlocked_us = 0;
+  stats_start = now;
+  portEXIT_CRITICAL(&stats_mux);
+
+  if (elapsed <= 0) return;
+
+  for (uint8_t i = 0; i < NUM_POWER_LOCKS; i++) {
+    ESP_LOGI(TAG, "%s held %d.%d%%", LOCK_CONFIGS[i].name, (uint32_t) (held_us[i] * 100 / elapsed), (uint32_t) (held_us[i] * 1000 / elapsed % 10));
+  }
+  ESP_LOGI(TAG, "no lock held %d.%d%%", (uint32_t) (idle_us * 100 / elapsed), (uint32_t) (idle_us * 1000 / elapsed % 10));
+
+  #ifdef CONFIG_PM_PROFILING
+    // time spent in each power mode, including light sleep
+    esp_pm_dump_locks(stdout);
+  #endif
+}
+
+#else
+
+void power_init(void) {
+  ESP_LOGD(TAG, "power management disabled");
+}
+
+void power_acquire(power_lock_t lock) {}
+void power_release(power_lock_t lock) {}
+void power_log_stats(void) {}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef POWER_H
+#define POWER_H
+
+/*
+  power management between samples, enabled by CONFIG_NODE_POWER_SAVE
+
+  the CPU runs at the lowest frequency, or light sleeps, unless one of the
+  locks below is held. each subsystem holds its lock only while it has work
+  in flight. without CONFIG_NODE_POWER_SAVE these functions do nothing
+*/
+
+typedef enum {
+  // sensor transactions and processing
+  POWER_LOCK_SPI = 0,
+  // SD card writes
+  POWER_LOCK_SD,
+  // a transfer with the collector is in progress
+  POWER_LOCK_RADIO,
+  // the radio is listening for SYNCs from the collector
+  POWER_LOCK_LISTEN,
+  // GPS messages are being received, or a pps edge is expected
+  POWER_LOCK_GPS,
+  NUM_POWER_LOCKS
+} power_lock_t;
+
+void power_init(void);
+void power_acquire(power_lock_t lock);
+void power_release(power_lock_t lock);
+
+// logs how long each lock was held, and how long no lock was held, since the last call
+void power_log_stats(void);
+
+#endif
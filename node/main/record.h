@@ -0,0 +1,70 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+/*
+  a sample is a fixed size packed record_t struct, described by a record_layout_t
+  that lists its fields in order. the layout of the records in a chunk is written
+  into the chunk header so the files can be decoded without knowing the firmware
+
+  each channel of a sensor is described by a struct with the following
+  members, and the sampler is instantiated for it at compile time:
+    typedef ... record_t;
+    static constexpr record_layout_t layout(void);
+
+  a tick without a sample inside a chunk is written as a record with every field
+  set to its missing value: 0xFFFF for U16, INT32_MIN for I32, UINT32_MAX for U32
+  and NaN for F32 and F64. sensors must not report these as readings
+*/
+
+static const uint8_t MAX_RECORD_FIELDS = 4;
+
+// what a field measures, and its unit
+typedef enum : uint8_t {
+  QUANTITY_NONE = 0,
+  QUANTITY_PRESSURE,      // Pa
+  QUANTITY_TEMPERATURE,   // degC
+  QUANTITY_HUMIDITY,      // %RH
+  QUANTITY_ADC_RAW        // counts
+} quantity_t;
+
+// how a field is stored, little endian
+typedef enum : uint8_t {
+  FIELD_U16 = 0,
+  FIELD_I32,
+  FIELD_U32,
+  FIELD_F32,
+  FIELD_F64
+} field_type_t;
+
+typedef struct __attribute__((__packed__)) {
+  quantity_t quantity;
+  field_type_t type;
+  // the value in the unit of quantity is the stored value / divisor
+  uint16_t divisor;
+} field_desc_t;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t num_fields;
+  // unused fields are {QUANTITY_NONE, 0, 0}
+  field_desc_t fields[MAX_RECORD_FIELDS];
+} record_layout_t;
+
+constexpr uint8_t field_size(field_type_t type) {
+  return type == FIELD_U16 ? 2 :
+         type == FIELD_F64 ? 8 : 4;
+}
+
+constexpr uint32_t layout_size(const record_layout_t &layout, uint8_t i = 0) {
+  return i >= layout.num_fields ? 0 : field_size(layout.fields[i].type) + layout_size(layout, i + 1);
+}
+
+// checks at compile time that channel_t::layout() describes channel_t::record_t
+template <typename channel_t>
+constexpr bool layout_matches(void) {
+  return channel_t::layout().num_fields <= MAX_RECORD_FIELDS &&
+         layout_size(channel_t::layout()) == sizeof(typename channel_t::record_t);
+}
+
+#endif
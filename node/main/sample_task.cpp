@@ -1,8 +1,14 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
 #include <sys/time.h>
-#include <dirent.h>
+#include <sys/unistd.h>
 #include "driver/rtc_cntl.h"
 #include "soc/rtc_cntl_reg.h"
+#include "soc/sens_reg.h"
+#include "soc/rtc.h"
+#include "esp32/clk.h"
 #include "esp32/ulp.h"
 #include "driver/gpio.h"
 #include "driver/rtc_io.h"
@@ -11,18 +17,30 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp32/rom/crc.h"
 
 #include "sensor.h"
+#include "spi_adc.h"
+#include "log_store.h"
+#include "power.h"
 
 #include "sample_task.h"
 #include "monitor_task.h"
 #include "common.h"
+#include "clock.h"
 #include "board.h"
 
 uint16_t sample_file_index;
 SemaphoreHandle_t sample_file_semaph;
 SemaphoreHandle_t time_acquired_semaph;
 
+// summary of files on the SD card, sent to the collector in the SYNC reply
+static sync_summary_t catalog;
+// set once get_largest_file has filled in catalog
+static bool catalog_ready = false;
+static portMUX_TYPE catalog_mux = portMUX_INITIALIZER_UNLOCKED;
+
 extern const uint8_t bin_start[] asm("_binary_ulp_main_bin_start");
 extern const uint8_t bin_end[]   asm("_binary_ulp_main_bin_end");
 
@@ -31,49 +49,487 @@ static const char *TAG = "sample";
 TaskHandle_t sample_task_handle;
 TaskHandle_t sample_write_task_handle;
 
-char *sample_buffers[2];
-uint32_t sample_count[2] = {0};
-uint64_t sample_start_time[2] = {0};
-uint8_t cur_buf = 0;
+// each chunk is a chunk_header_t, sample_count samples and CHUNK_COMMIT
+// the samples of a chunk are evenly spaced, sample i was taken at
+// timestamp + i * period_ns / 1000. up to MAX_FILL_RECORDS missed ticks in a row are
+// written as missing records (see record.h), a longer gap ends the chunk early
+typedef struct __attribute__((__packed__)) {
+  char header[3] = {'C', 'H', 'K'};
+  // time of the first sample (us)
+  uint64_t timestamp;
+  // sampling tick of the first sample, counted from the start of sampling
+  uint32_t start_tick;
+  // spacing of the samples, measured with the PPS disciplined clock
+  uint32_t period_ns;
+  // ticks between the last sample of the previous chunk of this stream and the
+  // first sample of this one that have no sample, beyond the normal spacing
+  uint32_t missed_ticks;
+  // size of one record
+  uint8_t sample_size;
+  uint32_t sample_count;
+  record_layout_t layout;
+  // crc32 of the fields above and the samples
+  uint32_t crc;
+} chunk_header_t;
+
+static const char CHUNK_HEADER[3] = {'C', 'H', 'K'};
+// written after the samples, a chunk without it was cut off while being written
+static const char CHUNK_COMMIT[4] = {'C', 'M', 'I', 'T'};
+// header of chunks written before the crc was added, these cannot be checked
+static const char LEGACY_HEADER[3] = {'H', 'D', 'R'};
+
+// records the file that was being written when the node was shut down, and its size
+// if it still matches on the next boot, the file does not have to be checked
+// kept in its own directory, away from the sample files and their buckets
+static const char *SEAL_NAME = "sys/seal";
+
+typedef struct {
+  uint16_t file_index;
+  uint32_t size;
+} seal_t;
+
+// records of one channel, double buffered between the sampler and sample_write_task
+// each stream is written as its own chunks, with the layout of its records
+typedef struct {
+  char *buffers[2];
+  // number of records in each buffer
+  uint32_t count[2];
+  // tick and esp_timer time of the first and last record in each buffer
+  uint32_t start_tick[2];
+  int64_t start_local[2];
+  int64_t end_local[2];
+  uint32_t missed_ticks[2];
+  // set while a buffer waits for or is being written by sample_write_task
+  volatile bool in_flight[2];
+  uint8_t cur_buf;
+  // records dropped because both buffers were in flight
+  volatile uint32_t dropped_records;
+  uint32_t logged_dropped_records;
+
+  // ticks between consecutive records, and the nominal period of that (ns)
+  uint32_t tick_step;
+  uint32_t nominal_period_ns;
+  bool has_last;
+  uint32_t last_tick;
+
+  // records per buffer
+  uint32_t buffer_num;
+  uint8_t record_size;
+  record_layout_t layout;
+} sample_stream_t;
+
+typedef enum {
+  STREAM_FAST = 0,
+  STREAM_SLOW,
+  NUM_STREAMS
+} stream_id_t;
+
+// gaps of up to this many records are filled with missing records instead of ending the chunk,
+// so late or dropped samples do not split a stream into many tiny chunks
+static const uint32_t MAX_FILL_RECORDS = 16;
+
+// sent to sample_write_task for each buffer to write
+typedef struct {
+  uint8_t stream;
+  uint8_t buf;
+} write_req_t;
+
+// sent after the last buffers on shutdown
+static const uint8_t STREAM_SHUTDOWN = 0xFF;
+
+static sample_stream_t streams[NUM_STREAMS];
+static uint8_t num_streams = 0;
+static QueueHandle_t write_queue;
+
+// ulp_tick_count at the last call to read_ulp_ticks
+static uint16_t ulp_last_count = 0;
+// ticks recorded by the ULP that were not sampled because the main CPU was late
+static uint32_t missed_ticks = 0;
 
 static void ulp_isr(void *arg) {
   xTaskNotify(sample_task_handle, 0, eNoAction);
 }
 
-static uint16_t get_largest_file(void) {
-  const char *TAG = "get_largest_file";
+// returns the number of ticks the ULP has counted since the last call, and the
+// RTC timer (low 32 bits) at the latest one
+static uint16_t read_ulp_ticks(uint32_t *rtc_time) {
+  // only the low 16 bits of each word in RTC memory are written by the ULP
+  uint16_t count;
+  do {
+    count = ulp_tick_count & 0xFFFF;
+    *rtc_time = (ulp_tick_time_hi & 0xFFFF) << 16 | (ulp_tick_time_lo & 0xFFFF);
+  } while (count != (ulp_tick_count & 0xFFFF));
+
+  uint16_t num_ticks = count - ulp_last_count;
+  ulp_last_count = count;
+  return num_ticks;
+}
+
+/*
+  the ULP timer runs off the RTC slow clock, which drifts with temperature by far
+  more than the samples are allowed to. once the PPS disciplined clock is valid,
+  the time of every tick is compared against the UTC grid of multiples of
+  CONFIG_SAMPLE_PERIOD, and the ULP sleep period is steered with a PI loop so the
+  ticks stay on it. the period is set in 1/65536 of a slow clock cycle, dithered
+  onto whole cycles tick by tick
+*/
+// ticks that the phase error is averaged over before each correction, about a second
+static const uint32_t DISCIPLINE_TICKS = CONFIG_SAMPLE_PERIOD < 1000000 ? 1000000 / CONFIG_SAMPLE_PERIOD : 1;
+// the phase error is removed over PHASE_GAIN intervals, and 1/FREQ_GAIN of it is integrated
+static const int64_t PHASE_GAIN = 4;
+static const int64_t FREQ_GAIN = 32;
+// limits on the period corrections (ns)
+static const int64_t MAX_FREQ_CORRECTION = (int64_t) CONFIG_SAMPLE_PERIOD * 1000 / 20;
+static const int64_t MAX_PHASE_CORRECTION = (int64_t) CONFIG_SAMPLE_PERIOD * 1000 / 1000;
+// intervals between logs of the discipline metrics
+static const uint32_t DISCIPLINE_LOG_INTERVALS = 60;
+
+static struct {
+  // estimated correction for the slow clock frequency error (ns per tick)
+  int64_t freq_ns;
+  // period the ULP is currently set to (ns)
+  int64_t period_ns;
+  // fraction of a cycle carried over to the next tick, 16 bit fixed point
+  uint64_t cycles_frac;
+
+  int64_t phase_sum_us;
+  uint32_t phase_count;
+
+  // metrics since the last log
+  uint32_t num_intervals;
+  int64_t abs_phase_sum_us;
+  int64_t max_abs_phase_us;
+} discipline = {0, (int64_t) CONFIG_SAMPLE_PERIOD * 1000, 0, 0, 0, 0, 0, 0};
+
+static int64_t clamp(int64_t x, int64_t limit) {
+  if (x > limit) return limit;
+  if (x < -limit) return -limit;
+  return x;
+}
+
+// same as ulp_set_wakeup_period(0, ...), but in ns and without dropping the fraction of a cycle
+static void set_ulp_period_ns(int64_t period_ns) {
+  // esp_clk_slowclk_cal_get() is the length of a slow clock cycle in us, RTC_CLK_CAL_FRACT bit fixed point
+  // converted to us first, so the shift does not overflow for periods up to the 1s SAMPLE_PERIOD allows
+  uint64_t period_us_q16 = ((uint64_t) period_ns << 16) / 1000;
+  uint64_t cycles_q16 = (period_us_q16 << RTC_CLK_CAL_FRACT) / esp_clk_slowclk_cal_get();
+
+  discipline.cycles_frac += cycles_q16;
+  uint32_t cycles = discipline.cycles_frac >> 16;
+  discipline.cycles_frac &= 0xFFFF;
+
+  REG_SET_FIELD(SENS_ULP_CP_SLEEP_CYC0_REG, SENS_SLEEP_CYCLES_S0, cycles);
+}
+
+// esp_timer time of rtc_time, the low 32 bits of the RTC timer at a time before now_local
+static int64_t rtc_to_local(uint32_t rtc_time, int64_t now_local) {
+  uint32_t now_rtc = rtc_time_get();
+  uint32_t cycles = now_rtc - rtc_time;
+  return now_local - (int64_t) (((uint64_t) cycles * esp_clk_slowclk_cal_get()) >> RTC_CLK_CAL_FRACT);
+}
+
+// called for every wake of the sample task, tick_local is the time the ULP latched at the latest tick
+static void discipline_ulp(int64_t tick_local, uint16_t num_ticks) {
+  const int64_t period_us = CONFIG_SAMPLE_PERIOD;
+
+  // the latched time is exact even when the main CPU woke up late, only a wake without a tick is skipped
+  if (clock_valid() && num_ticks > 0) {
+    int64_t phase = get_time_at(tick_local) % period_us;
+    if (phase >= period_us / 2) phase -= period_us;
+
+    discipline.phase_sum_us += phase;
+    discipline.phase_count ++;
+
+    int64_t abs_phase = phase < 0 ? -phase : phase;
+    discipline.abs_phase_sum_us += abs_phase;
+    if (abs_phase > discipline.max_abs_phase_us) discipline.max_abs_phase_us = abs_phase;
+  }
+
+  if (discipline.phase_count >= DISCIPLINE_TICKS) {
+    int64_t mean_ns = discipline.phase_sum_us * 1000 / discipline.phase_count;
+
+    // ticks that are late need a shorter period
+    discipline.freq_ns = clamp(discipline.freq_ns - mean_ns / (DISCIPLINE_TICKS * FREQ_GAIN), MAX_FREQ_CORRECTION);
+    int64_t phase_ns = clamp(-mean_ns / (DISCIPLINE_TICKS * PHASE_GAIN), MAX_PHASE_CORRECTION);
+    discipline.period_ns = period_us * 1000 + discipline.freq_ns + phase_ns;
+
+    discipline.num_intervals ++;
+    if (discipline.num_intervals == DISCIPLINE_LOG_INTERVALS) {
+      uint32_t num_samples = DISCIPLINE_LOG_INTERVALS * discipline.phase_count;
+      ESP_LOGI(TAG, "ulp phase error mean=%dus max=%dus, period correction=%dppm",
+        (int32_t) (discipline.abs_phase_sum_us / num_samples), (int32_t) discipline.max_abs_phase_us,
+        (int32_t) (discipline.freq_ns * 1000 / period_us));
+
+      discipline.num_intervals = 0;
+      discipline.abs_phase_sum_us = 0;
+      discipline.max_abs_phase_us = 0;
+    }
+
+    discipline.phase_sum_us = 0;
+    discipline.phase_count = 0;
+  }
+
+  set_ulp_period_ns(discipline.period_ns);
+}
+
+static uint32_t chunk_crc(const chunk_header_t *chunk_header, const void *data, uint32_t data_len) {
+  uint32_t crc = crc32_le(0, (const uint8_t *) chunk_header, offsetof(chunk_header_t, crc));
+  return crc32_le(crc, (const uint8_t *) data, data_len);
+}
+
+static void get_seal_path(char *out) {
+  snprintf(out, LEN_MAX_FNAME, "%s/%s", SD_MOUNT_POINT, SEAL_NAME);
+}
+
+static void seal_write(uint16_t file_index) {
+  seal_t seal = {file_index, 0};
+  if (!get_file_size(file_index, &seal.size)) return;
+
+  char seal_path[LEN_MAX_FNAME];
+  get_seal_path(seal_path);
+
+  make_parent_dirs(seal_path);
+
+  FILE *fp = fopen(seal_path, "w");
+  if (fp == NULL) {
+    ESP_LOGE(TAG, "fopen %s failed", seal_path);
+    return;
+  }
+
+  fwrite(&seal, sizeof(seal_t), 1, fp);
+  fflush(fp);
+  fsync(fileno(fp));
+  fclose(fp);
+
+  ESP_LOGI(TAG, "sealed file_index=%d at %d bytes", seal.file_index, seal.size);
+}
+
+static bool seal_matches(uint16_t file_index, uint32_t size) {
+  char seal_path[LEN_MAX_FNAME];
+  get_seal_path(seal_path);
+
+  FILE *fp = fopen(seal_path, "r");
+  if (fp == NULL) return false;
+
+  seal_t seal;
+  bool ok = fread(&seal, sizeof(seal_t), 1, fp) == 1;
+  fclose(fp);
+
+  return ok && seal.file_index == file_index && seal.size == size;
+}
+
+// returns the number of bytes at the start of fp that are made up of complete chunks
+// with a valid crc, or size if the file was written in the legacy format
+static uint32_t find_valid_size(FILE *fp, uint32_t size, uint8_t *buf, uint32_t buf_size) {
+  uint32_t valid_size = 0;
+  chunk_header_t chunk_header;
+
+  while (fread(&chunk_header, sizeof(chunk_header_t), 1, fp) == 1) {
+    if (valid_size == 0 && memcmp(chunk_header.header, LEGACY_HEADER, sizeof(LEGACY_HEADER)) == 0) {
+      return size;
+    }
+
+    if (memcmp(chunk_header.header, CHUNK_HEADER, sizeof(CHUNK_HEADER)) != 0) break;
+
+    uint32_t remaining = chunk_header.sample_count * chunk_header.sample_size;
+    if (remaining > size - valid_size) break;
+
+    uint32_t crc = crc32_le(0, (const uint8_t *) &chunk_header, offsetof(chunk_header_t, crc));
 
+    while (remaining > 0) {
+      uint32_t btr = remaining < buf_size ? remaining : buf_size;
+      if (fread(buf, 1, btr, fp) != btr) break;
+
+      crc = crc32_le(crc, buf, btr);
+      remaining -= btr;
+    }
+
+    if (remaining > 0 || crc != chunk_header.crc) break;
+
+    char commit[sizeof(CHUNK_COMMIT)];
+    if (fread(commit, sizeof(commit), 1, fp) != 1 || memcmp(commit, CHUNK_COMMIT, sizeof(CHUNK_COMMIT)) != 0) break;
+
+    valid_size = ftell(fp);
+  }
+
+  return valid_size;
+}
+
+// truncates file_index after its last valid chunk, unless it was sealed at this size
+// returns the new size of the file
+static uint32_t recover_file(uint16_t file_index, uint32_t size) {
+  if (seal_matches(file_index, size)) {
+    ESP_LOGI(TAG, "file_index=%d was sealed, skipping check", file_index);
+    return size;
+  }
+
+  char fname[LEN_MAX_FNAME];
+  get_index_path(file_index, fname);
+
+  FILE *fp = fopen(fname, "r");
+  uint8_t *buf = (uint8_t *) malloc(CONFIG_WRITE_BUF_SIZE);
+
+  if (fp == NULL || buf == NULL) {
+    ESP_LOGE(TAG, "unable to check %s", fname);
+    if (fp != NULL) fclose(fp);
+    free(buf);
+    return size;
+  }
+
+  uint32_t valid_size = find_valid_size(fp, size, buf, CONFIG_WRITE_BUF_SIZE);
+  fclose(fp);
+  free(buf);
+
+  if (valid_size < size) {
+    ESP_LOGW(TAG, "truncating %s from %d to %d bytes", fname, size, valid_size);
+
+    if (truncate(fname, valid_size) != 0) {
+      ESP_LOGE(TAG, "truncate %s failed", fname);
+      return size;
+    }
+  }
+
+  return valid_size;
+}
+
+// returns the largest file index on the SD card, and initialises catalog from the existing files
+// the largest file is the only one that can have been cut off, so it is checked and recovered here
+static uint16_t get_largest_file(void) {
   uint16_t largest = 0;
+  uint32_t largest_size = 0;
+  uint32_t total_bytes = 0;
 
-  DIR *d = opendir(SD_MOUNT_POINT);
-  if (d == NULL) {
-    ESP_LOGW(TAG, "failed to open %s", SD_MOUNT_POINT);
-    return largest;
+  uint16_t num_files = list_index_files(NULL, UINT16_MAX);
+  uint16_t *indices = (uint16_t *) malloc(num_files * sizeof(uint16_t));
+  if (indices != NULL) {
+    num_files = list_index_files(indices, num_files);
+  } else {
+    num_files = 0;
   }
 
-  struct dirent *dir;
+  for (uint16_t i = 0; i < num_files; i++) {
+    uint32_t size = 0;
+    get_file_size(indices[i], &size);
+    total_bytes += size;
 
-  while ((dir = readdir(d)) != NULL) {
-    if (dir->d_type != DT_REG) continue;
+    if (indices[i] > largest) {
+      largest = indices[i];
+      largest_size = size;
+    }
+  }
 
-    uint16_t num;
-    if (!conv_strtoul(dir->d_name, &num)) continue;
+  free(indices);
 
-    if (num > largest) largest = num;
+  if (largest != 0) {
+    uint32_t valid_size = recover_file(largest, largest_size);
+    total_bytes -= largest_size - valid_size;
+    largest_size = valid_size;
   }
 
-  closedir(d);
+  #ifdef CONFIG_LOG_STORE
+    uint32_t log_bytes;
+    uint16_t num_log_files = log_store_count_files(&log_bytes);
+    total_bytes += log_bytes;
+
+    file_list_entry_t *log_files = (file_list_entry_t *) malloc(num_log_files * sizeof(file_list_entry_t));
+    if (log_files != NULL) {
+      num_log_files = log_store_list_files(log_files, num_log_files, NULL);
+
+      for (uint16_t i = 0; i < num_log_files; i++) {
+        if (log_files[i].index > largest) {
+          largest = log_files[i].index;
+          largest_size = log_files[i].size;
+        }
+      }
+
+      free(log_files);
+    }
+  #endif
+
+  portENTER_CRITICAL(&catalog_mux);
+  catalog.total_bytes = total_bytes;
+  catalog.newest_index = largest;
+  catalog.newest_size = largest_size;
+  // the generation is not stored, so it is derived from the files. the same files give the same
+  // generation after a reboot, and a collector that synced before the reboot can still skip the node
+  catalog.generation = crc32_le(0, (const uint8_t *) &catalog + sizeof(catalog.generation), sizeof(sync_summary_t) - sizeof(catalog.generation));
+  catalog_ready = true;
+  portEXIT_CRITICAL(&catalog_mux);
+
   return largest;
 }
 
-static void sample_write_task(void *pvParameter) {
-  // initialise buffers (in external PSRAM)
-  for(uint8_t i = 0; i < 2; i++) {
-    sample_buffers[i] = (char *) heap_caps_malloc(CONFIG_SAMPLE_BUFFER_NUM * sizeof(TYPE_SENSOR_READING), MALLOC_CAP_SPIRAM);
+static void catalog_append(uint16_t file_index, uint32_t btw) {
+  portENTER_CRITICAL(&catalog_mux);
+  catalog.generation ++;
+  catalog.total_bytes += btw;
+
+  if (catalog.newest_index != file_index) {
+    catalog.newest_index = file_index;
+    catalog.newest_size = 0;
+  }
+  catalog.newest_size += btw;
+  portEXIT_CRITICAL(&catalog_mux);
+}
+
+bool get_sync_summary(sync_summary_t *summary) {
+  portENTER_CRITICAL(&catalog_mux);
+  bool ready = catalog_ready;
+  *summary = catalog;
+  portEXIT_CRITICAL(&catalog_mux);
+
+  return ready;
+}
+
+// appends a chunk to sample_file_index on the FAT partition
+static bool write_chunk_file(const chunk_header_t *chunk_header, const char *data, uint32_t data_len, char *file_buffer) {
+  if (xSemaphoreTake(sample_file_semaph, 0) == pdFALSE) {
+    ESP_LOGI(TAG, "waiting to acquire semaphore");
+    // TODO: make this timeout, if fail to acquire then write to
+    // sample_file_index ++
+    xSemaphoreTake(sample_file_semaph, portMAX_DELAY);
+    ESP_LOGI(TAG, "taken semaphore");
+  }
+
+  char fname[LEN_MAX_FNAME];
+  get_index_path(sample_file_index, fname);
+
+  FILE *fp = fopen(fname, "a");
+  if (fp == NULL) {
+    ESP_LOGE(TAG, "fopen %s failed", fname);
+    xSemaphoreGive(sample_file_semaph);
+    return false;
   }
 
+  if (setvbuf(fp, file_buffer, _IOFBF, CONFIG_WRITE_BUF_SIZE) != 0) {
+    ESP_LOGE(TAG, "setvbuf failed");
+    fclose(fp);
+    xSemaphoreGive(sample_file_semaph);
+    return false;
+  }
+
+  size_t bw = fwrite(chunk_header, sizeof(chunk_header_t), 1, fp) * sizeof(chunk_header_t);
+  bw += fwrite(data, 1, data_len, fp);
+
+  fclose(fp);
+  catalog_append(sample_file_index, bw);
+  ESP_LOGI(TAG, "write done");
+  xSemaphoreGive(sample_file_semaph);
+
+  return bw == sizeof(chunk_header_t) + data_len;
+}
+
+static void sample_write_task(void *pvParameter) {
   sample_file_index = get_largest_file();
 
+  #ifdef CONFIG_LOG_STORE
+    // files in a log that could not be recovered this boot are not listed, but would
+    // shadow files with the same index once it can be read again
+    if (log_store_last_file_index() > sample_file_index) {
+      sample_file_index = log_store_last_file_index();
+    }
+  #endif
+
   if (sample_file_index == 0) {
     sample_file_index = 1;
   } else {
@@ -82,66 +538,243 @@ static void sample_write_task(void *pvParameter) {
 
   ESP_LOGI(TAG, "samples will be written to file_index=%d", sample_file_index);
 
+  char sample_fname[LEN_MAX_FNAME];
+  get_index_path(sample_file_index, sample_fname);
+  make_parent_dirs(sample_fname);
+
   char * file_buffer = (char *) malloc(CONFIG_WRITE_BUF_SIZE);
 
   assert(file_buffer != NULL);
 
-  struct __attribute__((__packed__)) {
-    char header[3] = {'H', 'D', 'R'};
-    uint64_t timestamp;
-    uint8_t sample_size;
-    uint32_t sample_count;
-  } chunk_header;
+  chunk_header_t chunk_header;
+
+  #ifdef CONFIG_LOG_STORE
+    bool use_log_store = log_store_ready();
+    if (use_log_store) ESP_LOGI(TAG, "samples will be written to the log partition");
+  #endif
 
   while(1) {
-    uint32_t buf_index;
-    xTaskNotifyWait(0, 0, &buf_index, portMAX_DELAY);
-    ESP_LOGI(TAG, "writing buffer %d to file", buf_index);
+    write_req_t req;
+    xQueueReceive(write_queue, &req, portMAX_DELAY);
 
-    if (xSemaphoreTake(sample_file_semaph, 0) == pdFALSE) {
-      ESP_LOGI(TAG, "waiting to acquire semaphore");
-      // TODO: make this timeout, if fail to acquire then write to
-      // sample_file_index ++
-      xSemaphoreTake(sample_file_semaph, portMAX_DELAY);
-      ESP_LOGI(TAG, "taken semaphore");
+    if (req.stream == STREAM_SHUTDOWN) {
+      ESP_LOGI(TAG, "sampling shutdown");
+      seal_write(sample_file_index);
+      Event_t evt = EVT_SHUTDOWN_WRITE_DONE;
+      xQueueSend(evt_queue, &evt, 0);
+      vTaskSuspend(NULL);
     }
 
-    char fname[LEN_MAX_FNAME];
-    snprintf(fname, LEN_MAX_FNAME, "%s/%d", SD_MOUNT_POINT, sample_file_index);
+    power_acquire(POWER_LOCK_SD);
 
-    FILE *fp = fopen(fname, "a");
-    if (fp == NULL) {
-      ESP_LOGE(TAG, "fopen %s failed", fname);
-      continue;
+    sample_stream_t *stream = &streams[req.stream];
+    char *buffer = stream->buffers[req.buf];
+    ESP_LOGI(TAG, "writing buffer %d of stream %d to file", req.buf, req.stream);
+
+    uint32_t count = stream->count[req.buf];
+    chunk_header.timestamp = get_time_at(stream->start_local[req.buf]);
+    chunk_header.start_tick = stream->start_tick[req.buf];
+    chunk_header.missed_ticks = stream->missed_ticks[req.buf];
+
+    // averaged over the whole chunk so the wake up jitter of single ticks mostly cancels out
+    if (count > 1) {
+      uint64_t end_time = get_time_at(stream->end_local[req.buf]);
+      chunk_header.period_ns = (end_time - chunk_header.timestamp) * 1000 / (count - 1);
+    } else {
+      chunk_header.period_ns = stream->nominal_period_ns;
     }
 
-    if (setvbuf(fp, file_buffer, _IOFBF, CONFIG_WRITE_BUF_SIZE) != 0) {
-      ESP_LOGE(TAG, "setvbuf failed");
-      continue;
+    chunk_header.sample_size = stream->record_size;
+    chunk_header.sample_count = count;
+    chunk_header.layout = stream->layout;
+
+    uint32_t data_len = chunk_header.sample_count * stream->record_size;
+    chunk_header.crc = chunk_crc(&chunk_header, buffer, data_len);
+
+    memcpy(buffer + data_len, CHUNK_COMMIT, sizeof(CHUNK_COMMIT));
+    data_len += sizeof(CHUNK_COMMIT);
+
+    bool written = false;
+
+    #ifdef CONFIG_LOG_STORE
+      if (use_log_store) {
+        written = log_store_append(sample_file_index, &chunk_header, sizeof(chunk_header_t), buffer, data_len);
+
+        if (written) {
+          catalog_append(sample_file_index, sizeof(chunk_header_t) + data_len);
+        } else {
+          // continue in a new file on the FAT partition so no file is split across both
+          use_log_store = false;
+
+          // mtftp_task holds the semaphore while it reads sample_file_index
+          xSemaphoreTake(sample_file_semaph, portMAX_DELAY);
+          sample_file_index ++;
+          xSemaphoreGive(sample_file_semaph);
+
+          get_index_path(sample_file_index, sample_fname);
+          make_parent_dirs(sample_fname);
+          ESP_LOGW(TAG, "log partition unusable, samples will be written to file_index=%d", sample_file_index);
+        }
+      }
+    #endif
+
+    if (!written) {
+      write_chunk_file(&chunk_header, buffer, data_len, file_buffer);
     }
 
-    chunk_header.timestamp = sample_start_time[buf_index];
-    chunk_header.sample_size = sizeof(TYPE_SENSOR_READING);
-    chunk_header.sample_count = sample_count[buf_index] + 1;
+    stream->count[req.buf] = 0;
+    stream->in_flight[req.buf] = false;
 
-    fwrite(&chunk_header, sizeof(chunk_header), 1, fp);
-    fwrite(sample_buffers[buf_index], sizeof(TYPE_SENSOR_READING), sample_count[buf_index] + 1, fp);
+    uint32_t dropped_records = stream->dropped_records;
+    if (dropped_records != stream->logged_dropped_records) {
+      ESP_LOGW(TAG, "%d records of stream %d dropped while writing, %d in total", dropped_records - stream->logged_dropped_records, req.stream, dropped_records);
+      stream->logged_dropped_records = dropped_records;
+    }
 
-    fclose(fp);
-    ESP_LOGI(TAG, "write done");
-    xSemaphoreGive(sample_file_semaph);
+    power_release(POWER_LOCK_SD);
+  }
+}
 
-    if (shutdown) {
-      ESP_LOGI(TAG, "sampling shutdown");
-      Event_t evt = EVT_SHUTDOWN_WRITE_DONE;
-      xQueueSend(evt_queue, &evt, 0);
-      vTaskSuspend(NULL);
+// tick_step is the number of ticks between records, and tick_period_ns the nominal length of a tick
+template <typename channel_t>
+static void stream_init(stream_id_t id, uint32_t buffer_num, uint32_t tick_step, uint32_t tick_period_ns) {
+  static_assert(layout_matches<channel_t>(), "layout() of the channel does not match its record_t");
+
+  sample_stream_t *stream = &streams[id];
+  stream->buffer_num = buffer_num;
+  stream->tick_step = tick_step;
+  stream->nominal_period_ns = tick_step * tick_period_ns;
+  stream->record_size = sizeof(typename channel_t::record_t);
+  stream->layout = channel_t::layout();
+
+  // initialise buffers (in external PSRAM)
+  // with space for CHUNK_COMMIT after the records so a chunk can be written in one go
+  for(uint8_t i = 0; i < 2; i++) {
+    stream->buffers[i] = (char *) heap_caps_malloc(buffer_num * stream->record_size + sizeof(CHUNK_COMMIT), MALLOC_CAP_SPIRAM);
+    assert(stream->buffers[i] != NULL);
+  }
+
+  if (id >= num_streams) num_streams = id + 1;
+}
+
+// writes the missing value of every field of layout into record
+static void fill_missing(char *record, const record_layout_t &layout) {
+  for (uint8_t i = 0; i < layout.num_fields; i++) {
+    switch (layout.fields[i].type) {
+      case FIELD_U16: { uint16_t v = UINT16_MAX; memcpy(record, &v, sizeof(v)); break; }
+      case FIELD_I32: { int32_t v = INT32_MIN; memcpy(record, &v, sizeof(v)); break; }
+      case FIELD_U32: { uint32_t v = UINT32_MAX; memcpy(record, &v, sizeof(v)); break; }
+      case FIELD_F32: { float v = NAN; memcpy(record, &v, sizeof(v)); break; }
+      case FIELD_F64: { double v = NAN; memcpy(record, &v, sizeof(v)); break; }
     }
+    record += field_size(layout.fields[i].type);
+  }
+}
+
+// hands the current buffer of a stream to sample_write_task and starts using the other one
+// never blocks: only buffers not yet in flight are sent, so the queue always has room
+static void hand_over(stream_id_t id) {
+  sample_stream_t *stream = &streams[id];
+  write_req_t req = {(uint8_t) id, stream->cur_buf};
+
+  stream->in_flight[stream->cur_buf] = true;
+  xQueueSend(write_queue, &req, 0);
+  stream->cur_buf = !stream->cur_buf;
+}
+
+// appends record, taken at tick (esp_timer time tick_local), to the current buffer of a stream
+// and hands the buffer over once it is full
+template <typename channel_t>
+static void store_sample(stream_id_t id, const typename channel_t::record_t &record, uint32_t tick, int64_t tick_local) {
+  sample_stream_t *stream = &streams[id];
+  uint32_t expected_tick = stream->last_tick + stream->tick_step;
+
+  // the writer has not finished with this buffer yet. the record is dropped, and the next
+  // stored one counts it as missed
+  if (stream->in_flight[stream->cur_buf]) {
+    stream->dropped_records ++;
+    return;
+  }
+
+  // a short gap is filled with missing records, as long as they and this record fit into the buffer.
+  // ticks wrap around, so the gap is their difference taken as signed
+  if (stream->count[stream->cur_buf] > 0 && tick != expected_tick) {
+    uint8_t buf = stream->cur_buf;
+    uint32_t gap = tick - expected_tick;
+    uint32_t fill = gap / stream->tick_step;
+
+    if ((int32_t) gap > 0 && gap % stream->tick_step == 0 && fill <= MAX_FILL_RECORDS &&
+        stream->count[buf] + fill < stream->buffer_num) {
+      for (uint32_t i = 0; i < fill; i++) {
+        fill_missing(stream->buffers[buf] + stream->count[buf] * stream->record_size, stream->layout);
+        stream->count[buf] ++;
+      }
+      expected_tick = tick;
+    }
+  }
+
+  // a longer gap ends the chunk, so the records of every chunk are evenly spaced
+  if (stream->count[stream->cur_buf] > 0 && tick != expected_tick) {
+    hand_over(id);
 
-    sample_count[buf_index] = 0;
+    if (stream->in_flight[stream->cur_buf]) {
+      stream->dropped_records ++;
+      return;
+    }
+  }
+
+  uint8_t buf = stream->cur_buf;
+
+  ((typename channel_t::record_t *) stream->buffers[buf])[stream->count[buf]] = record;
+  if (stream->count[buf] == 0) {
+    stream->start_tick[buf] = tick;
+    stream->start_local[buf] = tick_local;
+    stream->missed_ticks[buf] = stream->has_last ? tick - expected_tick : 0;
+  }
+
+  stream->end_local[buf] = tick_local;
+  stream->last_tick = tick;
+  stream->has_last = true;
+
+  stream->count[buf] ++;
+  if (stream->count[buf] == stream->buffer_num) {
+    hand_over(id);
+  }
+}
+
+// hands over the partly filled buffers of all streams, then has sample_write_task finish
+static void stop_sampling(void) {
+  for (uint8_t id = 0; id < num_streams; id++) {
+    uint8_t buf = streams[id].cur_buf;
+    if (!streams[id].in_flight[buf] && streams[id].count[buf] > 0) {
+      hand_over((stream_id_t) id);
+    }
   }
+
+  write_req_t req = {STREAM_SHUTDOWN, 0};
+  xQueueSend(write_queue, &req, 0);
 }
 
+#ifdef CONFIG_SAMPLE_SOURCE_ADC
+// set once the last buffers have been handed over, later conversions are ignored
+static bool adc_stopping = false;
+
+// called from the esp_timer task, so must never block
+static void store_adc_sample(TYPE_ADC_READING val, uint32_t tick, int64_t tick_time) {
+  if (adc_stopping) return;
+
+  spi_adc_record_t record = {val};
+  store_sample<spi_adc_channel>(STREAM_FAST, record, tick, tick_time);
+
+  if (shutdown) {
+    adc_stopping = true;
+    stop_sampling();
+    // the timer is stopped from sample_task
+    xTaskNotify(sample_task_handle, 0, eNoAction);
+  }
+}
+#endif
+
 void sample_task(void *pvParameter) {
   sample_file_semaph = xSemaphoreCreateBinary();
   // initialise to 1
@@ -149,6 +782,20 @@ void sample_task(void *pvParameter) {
   time_acquired_semaph = xSemaphoreCreateBinary();
 
   sample_task_handle = xTaskGetCurrentTaskHandle();
+
+#ifdef CONFIG_SAMPLE_SOURCE_ADC
+  // sized for the rate, so a buffer lasts ADC_BUFFER_TIME however fast the ADC is sampled
+  stream_init<spi_adc_channel>(STREAM_FAST, CONFIG_ADC_SAMPLE_RATE * CONFIG_ADC_BUFFER_TIME / 1000, 1, 1000000000 / CONFIG_ADC_SAMPLE_RATE);
+#else
+  // the slow stream fills up at the same time as the fast one
+  uint32_t slow_buffer_num = CONFIG_SAMPLE_BUFFER_NUM / CONFIG_SLOW_SAMPLE_DIV;
+  stream_init<bme280_pressure_channel>(STREAM_FAST, CONFIG_SAMPLE_BUFFER_NUM, 1, CONFIG_SAMPLE_PERIOD * 1000);
+  stream_init<bme280_climate_channel>(STREAM_SLOW, slow_buffer_num > 0 ? slow_buffer_num : 1, CONFIG_SLOW_SAMPLE_DIV, CONFIG_SAMPLE_PERIOD * 1000);
+#endif
+
+  // each stream has at most both of its buffers waiting, plus STREAM_SHUTDOWN
+  write_queue = xQueueCreate(NUM_STREAMS * 2 + 1, sizeof(write_req_t));
+
   xTaskCreate(sample_write_task, "sample_write_task", 4096, NULL, 5, &sample_write_task_handle);
 
   ESP_ERROR_CHECK(ulp_load_binary(0, bin_start, (bin_end - bin_start) / sizeof(uint32_t)));
@@ -164,6 +811,11 @@ void sample_task(void *pvParameter) {
   REG_SET_BIT(RTC_CNTL_INT_ENA_REG, RTC_CNTL_ULP_CP_INT_ENA_M);
   ESP_ERROR_CHECK(ulp_set_wakeup_period(0, CONFIG_SAMPLE_PERIOD));
 
+  #ifdef CONFIG_NODE_POWER_SAVE
+    // the wake instruction of the ULP program also wakes the chip from light sleep
+    ESP_ERROR_CHECK(esp_sleep_enable_ulp_wakeup());
+  #endif
+
 #ifndef CONFIG_START_WITHOUT_TIME_SYNC
   ESP_LOGI(TAG, "waiting for time sync");
   xSemaphoreTake(time_acquired_semaph, portMAX_DELAY);
@@ -175,37 +827,66 @@ void sample_task(void *pvParameter) {
   Event_t evt = EVT_TIME_SYNCED;
   xQueueSend(evt_queue, &evt, 0);
 
+#ifdef CONFIG_SAMPLE_SOURCE_ADC
+  spi_adc_init();
+  spi_adc_start(CONFIG_ADC_SAMPLE_RATE, &store_adc_sample);
+
+  xTaskNotifyWait(0, 0, NULL, portMAX_DELAY);
+  spi_adc_stop();
+  vTaskSuspend(NULL);
+#else
+  ulp_tick_count = 0;
   ESP_ERROR_CHECK(ulp_run(&ulp_entry - RTC_SLOW_MEM));
 
   sensor_init();
 
   bool started_sampling = false;
+  // ULP ticks since sampling started, including missed ones
+  uint32_t tick = 0;
+  // tick the reading in progress was started at, and when
+  uint32_t read_tick = 0;
+  int64_t read_local = 0;
   while(1) {
     xTaskNotifyWait(0, 0, NULL, portMAX_DELAY);
+    int64_t wake_local = esp_timer_get_time();
+
+    uint32_t rtc_time;
+    uint16_t num_ticks = read_ulp_ticks(&rtc_time);
+    // the ULP latched the RTC timer at the tick, without the wake up latency
+    discipline_ulp(rtc_to_local(rtc_time, wake_local), num_ticks);
+
+    if (num_ticks > 1) {
+      missed_ticks += num_ticks - 1;
+      ESP_LOGW(TAG, "sampling %d ticks late, %d missed in total", num_ticks - 1, missed_ticks);
+    }
 
     if (started_sampling) {
-      TYPE_SENSOR_READING val = sensor_read();
-      *(((TYPE_SENSOR_READING *) sample_buffers[cur_buf]) + sample_count[cur_buf]) = val;
-      if (sample_count[cur_buf] == 0) {
-        sample_start_time[cur_buf] = get_time();
-      }
+      // slow samples stay on multiples of CONFIG_SLOW_SAMPLE_DIV, one whose tick was missed is dropped
+      bool slow_tick = (read_tick % CONFIG_SLOW_SAMPLE_DIV) == 0;
+      bme280_pressure_record_t pressure;
+      bme280_climate_record_t climate;
 
-      if (sample_count[cur_buf] == (CONFIG_SAMPLE_BUFFER_NUM - 1) || shutdown) {
-        // notify other task to start write
-        xTaskNotify(sample_write_task_handle, cur_buf, eSetValueWithOverwrite);
+      sensor_read(&pressure, slow_tick ? &climate : NULL);
 
-        if (shutdown) {
-          vTaskSuspend(NULL);
-        }
+      store_sample<bme280_pressure_channel>(STREAM_FAST, pressure, read_tick, read_local);
+      if (slow_tick) {
+        store_sample<bme280_climate_channel>(STREAM_SLOW, climate, read_tick, read_local);
+      }
 
-        // start using other buffer
-        cur_buf = !cur_buf;
-      } else {
-        sample_count[cur_buf] ++;
+      if (shutdown) {
+        stop_sampling();
+        vTaskSuspend(NULL);
       }
     }
 
+    if (started_sampling) tick += num_ticks > 0 ? num_ticks : 1;
     started_sampling = true;
+
+    // the BME280 cannot be started by the ULP, so the conversion starts now and not at the
+    // latched tick time. the wake time is closer to when the pressure is actually measured
+    read_tick = tick;
+    read_local = wake_local;
     sensor_start_read();
   }
+#endif
 }
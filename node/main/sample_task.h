@@ -5,6 +5,8 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 
+#include "common.h"
+
 void sample_task(void *pvParameter);
 
 // this is used to protect access to the file with index sample_file_index
@@ -23,4 +25,8 @@ extern SemaphoreHandle_t sample_file_semaph;
 
 extern SemaphoreHandle_t time_acquired_semaph;
 
+// fills summary with a snapshot of the files currently on the SD card
+// returns false while the files are still being scanned at startup, summary is not valid then
+bool get_sync_summary(sync_summary_t *summary);
+
 #endif
@@ -4,12 +4,14 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
-#include "driver/gpio.h"
+#include "esp_attr.h"
 
 #include "board.h"
 #include "sensor.h"
+#include "power.h"
 
-#define BME280_FLOAT_ENABLE
+// the compensation mode (BME280_64BIT_ENABLE or the float default) is set for the
+// whole component in CMakeLists.txt, so bme280.c and this file agree on bme280_data
 #include "bme280/bme280.h"
 
 static const char *TAG = "sensor_task";
@@ -21,91 +23,117 @@ void user_delay_us(uint32_t period, void *intf_ptr)
   ets_delay_us(period);
 }
 
+// transactions queued with spi_device_queue_trans that have not been collected yet
+// they have to be collected before another transaction is sent with spi_device_transmit
+static uint8_t num_queued = 0;
+static spi_device_handle_t spi;
+
+static void collect_queued(void) {
+  spi_transaction_t *rt;
+
+  while (num_queued > 0) {
+    spi_device_get_trans_result(spi, &rt, portMAX_DELAY);
+    num_queued --;
+  }
+}
+
+// the register address is sent in the address phase of the same transaction as the data,
+// and CS is driven by the SPI controller
 int8_t user_spi_read(uint8_t reg_addr, uint8_t *reg_data, uint32_t len, void *intf_ptr)
 {
-  /* Return 0 for Success, non-zero for failure */
-  int8_t ret = 1;
+  spi_device_handle_t *dev_spi = (spi_device_handle_t *) intf_ptr;
 
-  spi_device_handle_t *spi = (spi_device_handle_t *) intf_ptr;
-
-  gpio_set_level(GPIO_SPI_CS_BME, 0);
+  collect_queued();
 
   spi_transaction_t t;
   memset(&t, 0, sizeof(t));
-  t.length = 8;
-  t.tx_buffer = &reg_addr;
-
-  if (spi_device_polling_transmit(*spi, &t) == ESP_OK) {
-    memset(&t, 0, sizeof(t));
-    t.length = len * 8;
-    t.rx_buffer = reg_data;
+  t.addr = reg_addr;
+  t.length = len * 8;
+  t.rxlength = len * 8;
+  t.rx_buffer = reg_data;
 
-    if (spi_device_polling_transmit(*spi, &t) == ESP_OK) {
-      ret = 0;
-    }
-  }
-
-  gpio_set_level(GPIO_SPI_CS_BME, 1);
-
-  return ret;
+  /* Return 0 for Success, non-zero for failure */
+  return spi_device_transmit(*dev_spi, &t) == ESP_OK ? 0 : 1;
 }
 
 int8_t user_spi_write(uint8_t reg_addr, const uint8_t *reg_data, uint32_t len, void *intf_ptr)
 {
-  /* Return 0 for Success, non-zero for failure */
-  int8_t ret = 1;
-
-  spi_device_handle_t *spi = (spi_device_handle_t *) intf_ptr;
+  spi_device_handle_t *dev_spi = (spi_device_handle_t *) intf_ptr;
 
-  gpio_set_level(GPIO_SPI_CS_BME, 0);
+  collect_queued();
 
   spi_transaction_t t;
   memset(&t, 0, sizeof(t));
-  t.length = 8;
-  t.tx_buffer = &reg_addr;
-
-  if (spi_device_polling_transmit(*spi, &t) == ESP_OK) {
-    t.length = len * 8;
-    t.tx_buffer = reg_data;
-
-    if (spi_device_polling_transmit(*spi, &t) == ESP_OK) {
-      ret = 0;
-    }
-  }
-
-  gpio_set_level(GPIO_SPI_CS_BME, 1);
+  t.addr = reg_addr;
+  t.length = len * 8;
+  t.tx_buffer = reg_data;
 
-  return ret;
+  /* Return 0 for Success, non-zero for failure */
+  return spi_device_transmit(*dev_spi, &t) == ESP_OK ? 0 : 1;
 }
 
-static spi_device_handle_t spi_init(void) {
-  spi_device_handle_t spi;
-
+void sensor_bus_init(void) {
   spi_bus_config_t buscfg;
   memset(&buscfg, 0, sizeof(spi_bus_config_t));
   buscfg.mosi_io_num = GPIO_SPI_MOSI;
   buscfg.miso_io_num = GPIO_SPI_MISO;
   buscfg.sclk_io_num = GPIO_SPI_SCLK;
+  buscfg.quadwp_io_num = -1;
+  buscfg.quadhd_io_num = -1;
+
+  // DMA channel 1, so transactions run without the CPU feeding the FIFO
+  ESP_ERROR_CHECK(spi_bus_initialize(SENSOR_SPI_HOST, &buscfg, 1));
+}
+
+static spi_device_handle_t spi_init(void) {
+  spi_device_handle_t spi;
 
   spi_device_interface_config_t devcfg;
   memset(&devcfg, 0, sizeof(spi_device_interface_config_t));
   devcfg.mode = 0,
-  devcfg.spics_io_num = -1;
+  devcfg.address_bits = 8;
+  devcfg.spics_io_num = GPIO_SPI_CS_BME;
   devcfg.clock_speed_hz = SENSOR_SPI_SPEED;
   devcfg.queue_size = 4;
 
-  ESP_ERROR_CHECK(spi_bus_initialize(SENSOR_SPI_HOST, &buscfg, 0));
+  sensor_bus_init();
   ESP_ERROR_CHECK(spi_bus_add_device(SENSOR_SPI_HOST, &devcfg, &spi));
 
-  // we manually assert/negate CS rather than using the SPI controller
-  gpio_set_direction(GPIO_SPI_CS_BME, GPIO_MODE_OUTPUT);
-  gpio_set_level(GPIO_SPI_CS_BME, 1);
-
   return spi;
 }
 
 struct bme280_dev dev;
-spi_device_handle_t spi;
+
+// transactions used while sampling, static so they stay valid while queued
+static spi_transaction_t read_trans;
+static spi_transaction_t start_trans;
+static DMA_ATTR uint8_t read_buf[BME280_P_T_H_DATA_LEN];
+
+// pressure and temperature registers, the start of BME280_P_T_H_DATA_LEN
+// temperature is always read because pressure compensation depends on it
+static const uint8_t BME280_P_T_DATA_LEN = 6;
+
+#ifdef CONFIG_BME280_NORMAL_MODE
+// standby times in us, indexed by the t_sb setting of the config register
+static const uint32_t STANDBY_TIMES[] = {500, 62500, 125000, 250000, 500000, 1000000, 10000, 20000};
+
+// returns the longest standby time for which a new conversion still completes every sample period
+static uint8_t select_standby_time(uint32_t meas_time_us) {
+  uint8_t best = BME280_STANDBY_TIME_0_5_MS;
+
+  for (uint8_t i = 0; i < sizeof(STANDBY_TIMES) / sizeof(STANDBY_TIMES[0]); i++) {
+    if (meas_time_us + STANDBY_TIMES[i] <= CONFIG_SAMPLE_PERIOD && STANDBY_TIMES[i] > STANDBY_TIMES[best]) {
+      best = i;
+    }
+  }
+
+  if (meas_time_us + STANDBY_TIMES[best] > CONFIG_SAMPLE_PERIOD) {
+    ESP_LOGW(TAG, "sample period is shorter than the measurement time, readings will repeat");
+  }
+
+  return best;
+}
+#endif
 
 void sensor_init(void) {
   spi = spi_init();
@@ -128,21 +156,92 @@ void sensor_init(void) {
 
   uint8_t settings_sel = BME280_OSR_PRESS_SEL | BME280_OSR_TEMP_SEL | BME280_OSR_HUM_SEL | BME280_FILTER_SEL;
 
+  #ifdef CONFIG_BME280_NORMAL_MODE
+    // the sensor converts continuously, and each tick reads the latest result
+    dev.settings.standby_time = select_standby_time(bme280_cal_meas_delay(&(dev.settings)) * 1000);
+    settings_sel |= BME280_STANDBY_SEL;
+  #endif
+
   bme280_set_sensor_settings(settings_sel, &dev);
-  bme280_set_sensor_mode(BME280_FORCED_MODE, &dev);
+
+  #ifdef CONFIG_BME280_NORMAL_MODE
+    bme280_set_sensor_mode(BME280_NORMAL_MODE, &dev);
+    ESP_LOGI(TAG, "normal mode, standby %dus", STANDBY_TIMES[dev.settings.standby_time]);
+  #else
+    bme280_set_sensor_mode(BME280_FORCED_MODE, &dev);
+  #endif
 
   ESP_LOGI(TAG, "min delay = %dms", bme280_cal_meas_delay(&(dev.settings)));
+
+  // burst read of the data registers, the length is set for each read
+  memset(&read_trans, 0, sizeof(spi_transaction_t));
+  read_trans.addr = BME280_DATA_ADDR | 0x80;
+  read_trans.rx_buffer = read_buf;
+
+  // ctrl_meas with the mode set to forced, which starts a conversion
+  // built once here so starting a conversion is a single write instead of bme280_set_sensor_mode's read-modify-write
+  uint8_t ctrl_meas;
+  bme280_get_regs(BME280_CTRL_MEAS_ADDR, &ctrl_meas, 1, &dev);
+
+  memset(&start_trans, 0, sizeof(spi_transaction_t));
+  start_trans.flags = SPI_TRANS_USE_TXDATA;
+  start_trans.addr = BME280_CTRL_MEAS_ADDR & 0x7F;
+  start_trans.length = 8;
+  start_trans.tx_data[0] = BME280_SET_BITS_POS_0(ctrl_meas, BME280_SENSOR_MODE, BME280_FORCED_MODE);
 }
 
-TYPE_SENSOR_READING sensor_read(void) {
+void sensor_read(bme280_pressure_record_t *pressure, bme280_climate_record_t *climate) {
+  uint8_t len = climate != NULL ? BME280_P_T_H_DATA_LEN : BME280_P_T_DATA_LEN;
+
+  power_acquire(POWER_LOCK_SPI);
+  collect_queued();
+
+  read_trans.length = len * 8;
+  read_trans.rxlength = len * 8;
+
+  // the task blocks until the DMA transaction completes, instead of the CPU polling the bus
+  spi_transaction_t *rt;
+  if (spi_device_queue_trans(spi, &read_trans, portMAX_DELAY) != ESP_OK ||
+      spi_device_get_trans_result(spi, &rt, portMAX_DELAY) != ESP_OK) {
+    ESP_LOGW(TAG, "failed to read sensor data");
+    memset(pressure, 0, sizeof(bme280_pressure_record_t));
+    if (climate != NULL) memset(climate, 0, sizeof(bme280_climate_record_t));
+    power_release(POWER_LOCK_SPI);
+    return;
+  }
+
+  // parse_sensor_data always parses all registers, humidity is only used if it was read
+  struct bme280_uncomp_data uncomp_data;
   struct bme280_data comp_data;
-  bme280_get_sensor_data(BME280_ALL, &comp_data, &dev);
+  bme280_parse_sensor_data(read_buf, &uncomp_data);
+  bme280_compensate_data(climate != NULL ? BME280_ALL : BME280_PRESS, &uncomp_data, &comp_data, &dev.calib_data);
+
+  #ifdef BME280_FLOAT_ENABLE
+    ESP_LOGV(TAG, "bme280: temp=%f pressure=%f humidity=%f",comp_data.temperature, comp_data.pressure, comp_data.humidity);
+  #else
+    ESP_LOGV(TAG, "bme280: temp=%d pressure=%d humidity=%d",comp_data.temperature, comp_data.pressure, comp_data.humidity);
+  #endif
 
-  ESP_LOGV(TAG, "bme280: temp=%f pressure=%f humidity=%f",comp_data.temperature, comp_data.pressure, comp_data.humidity);
+  pressure->pressure = comp_data.pressure;
 
-  return comp_data.pressure;
+  if (climate != NULL) {
+    climate->temperature = comp_data.temperature;
+    climate->humidity = comp_data.humidity;
+  }
+
+  power_release(POWER_LOCK_SPI);
 }
 
 void sensor_start_read(void) {
-  bme280_set_sensor_mode(BME280_FORCED_MODE, &dev);
+  #ifdef CONFIG_BME280_NORMAL_MODE
+    // conversions are started by the sensor itself
+    return;
+  #endif
+
+  // queued without waiting for it to complete, the result is collected before the next transaction
+  if (spi_device_queue_trans(spi, &start_trans, 0) == ESP_OK) {
+    num_queued ++;
+  } else {
+    ESP_LOGW(TAG, "failed to queue conversion start");
+  }
 }
\ No newline at end of file
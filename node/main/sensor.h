@@ -1,12 +1,77 @@
 #ifndef SENSOR_H
 #define SENSOR_H
 
-#define TYPE_SENSOR_READING double
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "record.h"
+
+#ifdef CONFIG_BME280_COMPENSATION_INT64
+  // fixed point, as output by the integer compensation
+  // sampled every tick
+  typedef struct __attribute__((__packed__)) {
+    // 0.01 Pa
+    uint32_t pressure;
+  } bme280_pressure_record_t;
+
+  // sampled every CONFIG_SLOW_SAMPLE_DIV ticks
+  typedef struct __attribute__((__packed__)) {
+    // 0.01 degC
+    int32_t temperature;
+    // 1/1024 %RH
+    uint32_t humidity;
+  } bme280_climate_record_t;
+#else
+  // sampled every tick
+  typedef struct __attribute__((__packed__)) {
+    float pressure;
+  } bme280_pressure_record_t;
+
+  // sampled every CONFIG_SLOW_SAMPLE_DIV ticks
+  typedef struct __attribute__((__packed__)) {
+    float temperature;
+    float humidity;
+  } bme280_climate_record_t;
+#endif
+
+// initialises the SPI bus shared by the BME280 and the ADC
+void sensor_bus_init(void);
 
 void sensor_init(void);
-TYPE_SENSOR_READING sensor_read(void);
+// reads pressure, and also temperature and humidity if climate is not NULL
+// only the data registers that are needed are read
+void sensor_read(bme280_pressure_record_t *pressure, bme280_climate_record_t *climate);
 void sensor_start_read(void);
 
+struct bme280_pressure_channel {
+  typedef bme280_pressure_record_t record_t;
+
+  static constexpr record_layout_t layout(void) {
+    #ifdef CONFIG_BME280_COMPENSATION_INT64
+      return {1, {{QUANTITY_PRESSURE, FIELD_U32, 100}}};
+    #else
+      return {1, {{QUANTITY_PRESSURE, FIELD_F32, 1}}};
+    #endif
+  }
+};
+
+struct bme280_climate_channel {
+  typedef bme280_climate_record_t record_t;
+
+  static constexpr record_layout_t layout(void) {
+    #ifdef CONFIG_BME280_COMPENSATION_INT64
+      return {2, {
+        {QUANTITY_TEMPERATURE, FIELD_I32, 100},
+        {QUANTITY_HUMIDITY, FIELD_U32, 1024}
+      }};
+    #else
+      return {2, {
+        {QUANTITY_TEMPERATURE, FIELD_F32, 1},
+        {QUANTITY_HUMIDITY, FIELD_F32, 1}
+      }};
+    #endif
+  }
+};
+
 void test(void);
 
 #endif
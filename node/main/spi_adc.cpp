@@ -0,0 +1,153 @@
+#include <string.h>
+#include "driver/spi_master.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "board.h"
+#include "sensor.h"
+#include "power.h"
+#include "spi_adc.h"
+
+#ifdef CONFIG_SAMPLE_SOURCE_ADC
+
+static const char *TAG = "spi_adc";
+
+// conversions in flight at once, so the bus keeps running while the timer task is delayed
+static const uint8_t ADC_QUEUE_LEN = 8;
+
+static spi_device_handle_t spi = NULL;
+static esp_timer_handle_t timer;
+// held by adc_tick while it runs, so spi_adc_stop can wait for a callback that is in progress
+static SemaphoreHandle_t tick_mutex = NULL;
+
+// transactions are queued and completed in order, so they are used round robin
+static spi_transaction_t trans[ADC_QUEUE_LEN];
+static uint8_t next_trans = 0;
+static uint8_t num_queued = 0;
+// tick and time each queued transaction was started at
+static uint32_t trans_tick[ADC_QUEUE_LEN];
+static int64_t trans_time[ADC_QUEUE_LEN];
+// wraps around after 2^32 periods, users compare ticks by their difference
+static uint32_t tick = 0;
+
+static spi_adc_sample_cb_t sample_cb;
+static volatile bool running = false;
+// ticks where a conversion was skipped because the bus was still busy with earlier ones
+static uint32_t num_overruns = 0;
+
+static void adc_tick(void *arg) {
+  spi_transaction_t *rt;
+
+  xSemaphoreTake(tick_mutex, portMAX_DELAY);
+
+  // a callback the timer task had already picked up when spi_adc_stop freed the device
+  if (spi == NULL) {
+    xSemaphoreGive(tick_mutex);
+    return;
+  }
+
+  // hand over conversions that have completed since the last tick
+  while (num_queued > 0 && spi_device_get_trans_result(spi, &rt, 0) == ESP_OK) {
+    num_queued --;
+
+    if (running) {
+      uint8_t i = rt - trans;
+      TYPE_ADC_READING val = (rt->rx_data[0] << 8) | rt->rx_data[1];
+      // 0xFFFF marks a missing sample in the files
+      if (val == 0xFFFF) val = 0xFFFE;
+      sample_cb(val, trans_tick[i], trans_time[i]);
+    }
+  }
+
+  if (running) {
+    uint32_t this_tick = tick ++;
+
+    if (num_queued == ADC_QUEUE_LEN) {
+      num_overruns ++;
+    } else {
+      trans_tick[next_trans] = this_tick;
+      trans_time[next_trans] = esp_timer_get_time();
+
+      if (spi_device_queue_trans(spi, &trans[next_trans], 0) == ESP_OK) {
+        num_queued ++;
+        next_trans = (next_trans + 1) % ADC_QUEUE_LEN;
+      } else {
+        num_overruns ++;
+      }
+    }
+  }
+
+  xSemaphoreGive(tick_mutex);
+}
+
+void spi_adc_init(void) {
+  spi_device_interface_config_t devcfg;
+  memset(&devcfg, 0, sizeof(spi_device_interface_config_t));
+  devcfg.mode = 0;
+  devcfg.spics_io_num = GPIO_SPI_CS_ADC;
+  devcfg.clock_speed_hz = CONFIG_ADC_SPI_SPEED;
+  devcfg.queue_size = ADC_QUEUE_LEN;
+
+  if (tick_mutex == NULL) tick_mutex = xSemaphoreCreateMutex();
+
+  sensor_bus_init();
+  ESP_ERROR_CHECK(spi_bus_add_device(SENSOR_SPI_HOST, &devcfg, &spi));
+
+  for (uint8_t i = 0; i < ADC_QUEUE_LEN; i++) {
+    memset(&trans[i], 0, sizeof(spi_transaction_t));
+    trans[i].flags = SPI_TRANS_USE_RXDATA | SPI_TRANS_USE_TXDATA;
+    trans[i].length = 16;
+    trans[i].rxlength = 16;
+  }
+
+  esp_timer_create_args_t timer_args;
+  memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+  timer_args.callback = &adc_tick;
+  timer_args.name = "spi_adc";
+
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+}
+
+void spi_adc_start(uint32_t rate_hz, spi_adc_sample_cb_t cb) {
+  sample_cb = cb;
+  num_overruns = 0;
+  tick = 0;
+  next_trans = 0;
+  running = true;
+
+  // conversions are too frequent to sleep between them
+  power_acquire(POWER_LOCK_SPI);
+
+  ESP_LOGI(TAG, "sampling at %dHz", rate_hz);
+  ESP_ERROR_CHECK(esp_timer_start_periodic(timer, 1000000 / rate_hz));
+}
+
+void spi_adc_stop(void) {
+  spi_transaction_t *rt;
+
+  running = false;
+  esp_timer_stop(timer);
+
+  // a callback can still be running, or about to run, after the timer is stopped
+  xSemaphoreTake(tick_mutex, portMAX_DELAY);
+
+  // the driver owns the queued transactions until they complete
+  while (num_queued > 0) {
+    ESP_ERROR_CHECK(spi_device_get_trans_result(spi, &rt, portMAX_DELAY));
+    num_queued --;
+  }
+
+  esp_timer_delete(timer);
+  ESP_ERROR_CHECK(spi_bus_remove_device(spi));
+  spi = NULL;
+
+  xSemaphoreGive(tick_mutex);
+
+  power_release(POWER_LOCK_SPI);
+
+  ESP_LOGI(TAG, "stopped, %d conversions skipped", num_overruns);
+}
+
+#endif
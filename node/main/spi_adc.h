@@ -0,0 +1,43 @@
+#ifndef SPI_ADC_H
+#define SPI_ADC_H
+
+#include <stdint.h>
+#include "record.h"
+
+/*
+  driver for the ADC on GPIO_SPI_CS_ADC
+
+  each conversion is one 16 bit SPI frame, started by CS going low and read
+  out MSB first. conversions are paced by a periodic timer, with up to
+  ADC_QUEUE_LEN transactions queued to the SPI driver at a time, so the DMA
+  transfers run back to back without the CPU waiting on the bus
+*/
+
+typedef uint16_t TYPE_ADC_READING;
+
+typedef struct __attribute__((__packed__)) {
+  TYPE_ADC_READING raw;
+} spi_adc_record_t;
+
+struct spi_adc_channel {
+  typedef spi_adc_record_t record_t;
+
+  static constexpr record_layout_t layout(void) {
+    return {1, {{QUANTITY_ADC_RAW, FIELD_U16, 1}}};
+  }
+};
+
+// called from the timer task for every conversion, in order
+// tick counts timer periods since spi_adc_start, skipped conversions leave gaps in it.
+// it wraps around after 2^32 periods (about 2.5 days at 20kHz), so compare ticks by their
+// difference, not their value
+// tick_time is the esp_timer time the conversion was started at
+typedef void (*spi_adc_sample_cb_t)(TYPE_ADC_READING val, uint32_t tick, int64_t tick_time);
+
+void spi_adc_init(void);
+void spi_adc_start(uint32_t rate_hz, spi_adc_sample_cb_t cb);
+// stops conversions and frees the device, cb is not called again once this returns.
+// spi_adc_init has to be called again before the next spi_adc_start
+void spi_adc_stop(void);
+
+#endif
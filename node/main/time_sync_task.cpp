@@ -4,14 +4,21 @@
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "driver/uart.h"
 #include <sys/time.h>
+#include "xtensa/hal.h"
 
 #include "board.h"
 #include "common.h"
+#include "clock.h"
 
 #include "sample_task.h"
+#include "power.h"
+#include "nmea.h"
+#include "ubx.h"
 
 static QueueHandle_t uart_queue;
 static const int UART_NUM = UART_NUM_2;
@@ -22,23 +29,185 @@ static const int QUEUE_LEN = 8;
 
 static const int ESP_INTR_FLAG_DEFAULT = 0;
 
-// system time where next_time was configured
+// latest GGA sentence with a valid fix
+static nmea_sentence_t position;
+static portMUX_TYPE position_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// system time where next_utc_ns was configured
 static int64_t next_time_arrival = -10000000;
-// absolute time, valid on next pps pulse
-static struct timeval next_time;
+// UTC of the next pps pulse (ns)
+static uint64_t next_utc_ns;
+// guards next_time_arrival and next_utc_ns between this task and pps_task
+static portMUX_TYPE next_time_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static TaskHandle_t pps_task_handle;
+
+// the pps edge captured by pps_isr_handler, handed to pps_task without a lock
+// seq is odd while the ISR is writing the slot
+static struct {
+  volatile uint32_t seq;
+  volatile int64_t local_us;
+} pps_slot;
+
+// most cycles spent in pps_isr_handler since pps_task last logged it
+// kept out of the slot because it is only known once the ISR is about to return
+static volatile uint32_t pps_isr_max_cycles = 0;
+
+// edges between logs of the pps statistics
+static const uint32_t PPS_STATS_EDGES = 60;
+
+// the GPS lock keeps the chip out of light sleep while a burst of messages is parsed, and
+// from shortly before each pps edge so the edge is timestamped by an awake chip. the edge
+// interrupt can't wake the chip itself, it would have to be a level interrupt for that
+static SemaphoreHandle_t gps_lock_mutex;
+static bool gps_lock_held = false;
+// time the lock was last taken or a message arrived
+static int64_t gps_wake_us;
+// set until the edge after the lock was taken for it has arrived. also set at startup, so
+// the lock is held until the first edge and whenever an expected edge is missed
+static bool gps_awaiting_edge = true;
+static esp_timer_handle_t pps_wake_timer;
+
+// the messages after an edge arrive as one burst, which is over once the UART has been
+// quiet for this long
+static const int GPS_IDLE_MS = 50;
+// how long before the next expected edge the lock is taken
+static const int64_t PPS_WAKE_MARGIN_US = 20000;
+
+static void gps_wake(void) {
+  xSemaphoreTake(gps_lock_mutex, portMAX_DELAY);
+  if (!gps_lock_held) {
+    power_acquire(POWER_LOCK_GPS);
+    gps_lock_held = true;
+  }
+  gps_wake_us = esp_timer_get_time();
+  xSemaphoreGive(gps_lock_mutex);
+}
+
+// releases the lock once the burst has been parsed, unless an edge is expected
+static void gps_try_sleep(void) {
+  xSemaphoreTake(gps_lock_mutex, portMAX_DELAY);
+  if (gps_lock_held && !gps_awaiting_edge && esp_timer_get_time() - gps_wake_us >= GPS_IDLE_MS * 1000) {
+    power_release(POWER_LOCK_GPS);
+    gps_lock_held = false;
+  }
+  xSemaphoreGive(gps_lock_mutex);
+}
+
+static void pps_wake_callback(void *arg) {
+  xSemaphoreTake(gps_lock_mutex, portMAX_DELAY);
+  gps_awaiting_edge = true;
+  xSemaphoreGive(gps_lock_mutex);
+
+  gps_wake();
+}
+
+// takes the lock again shortly before the edge after the one at local_us
+static void pps_schedule_wake(int64_t local_us) {
+  xSemaphoreTake(gps_lock_mutex, portMAX_DELAY);
+  gps_awaiting_edge = false;
+  xSemaphoreGive(gps_lock_mutex);
+
+  int64_t timeout_us = local_us + 1000000 - PPS_WAKE_MARGIN_US - esp_timer_get_time();
+  if (timeout_us <= 0) return;
+
+  esp_timer_stop(pps_wake_timer);
+  esp_timer_start_once(pps_wake_timer, timeout_us);
+}
 
 static void IRAM_ATTR pps_isr_handler(void *arg) {
-  // sanity check that the value of next_time was set within the last second
-  if ((esp_timer_get_time() - next_time_arrival) > 950000) return;
+  uint32_t start = xthal_get_ccount();
+  int64_t now = esp_timer_get_time();
 
-  settimeofday(&next_time, NULL);
+  pps_slot.seq ++;
+  pps_slot.local_us = now;
+  pps_slot.seq ++;
 
-  BaseType_t xHigherPriorityTaskWoken;
-  xSemaphoreGiveFromISR(time_acquired_semaph, &xHigherPriorityTaskWoken);
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(pps_task_handle, &xHigherPriorityTaskWoken);
+
+  uint32_t cycles = xthal_get_ccount() - start;
+  if (cycles > pps_isr_max_cycles) pps_isr_max_cycles = cycles;
   if (xHigherPriorityTaskWoken) portYIELD_FROM_ISR();
 }
 
+// applies the pps edges captured by pps_isr_handler to the clock
+static void pps_task(void *pvParameter) {
+  const char *TAG = "pps";
+
+  uint32_t num_edges = 0;
+  int64_t sum_delay_us = 0;
+  int64_t max_delay_us = 0;
+  int32_t min_offset_ns = INT32_MAX;
+  int32_t max_offset_ns = INT32_MIN;
+
+  while(1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    uint32_t seq;
+    int64_t local_us;
+    do {
+      seq = pps_slot.seq;
+      local_us = pps_slot.local_us;
+    } while ((seq & 1) || seq != pps_slot.seq);
+
+    int64_t delay_us = esp_timer_get_time() - local_us;
+
+    pps_schedule_wake(local_us);
+
+    portENTER_CRITICAL(&next_time_mux);
+    // sanity check that next_utc_ns was set within the second before the edge. if it was
+    // set after the edge it is already the time of the next one
+    int64_t age_us = local_us - next_time_arrival;
+    bool fresh = age_us >= 0 && age_us <= 950000;
+    uint64_t utc_ns = next_utc_ns;
+    portEXIT_CRITICAL(&next_time_mux);
+
+    if (!fresh) continue;
+
+    // the system time is only set when the clock steps, otherwise get_time() is slewed
+    if (clock_on_pps(local_us, utc_ns)) {
+      struct timeval next_time;
+      next_time.tv_sec = utc_ns / 1000000000;
+      next_time.tv_usec = (utc_ns % 1000000000) / 1000;
+      settimeofday(&next_time, NULL);
+    }
+
+    xSemaphoreGive(time_acquired_semaph);
+
+    int32_t offset_ns, freq_ppb;
+    clock_get_stats(&offset_ns, &freq_ppb);
+
+    num_edges ++;
+    sum_delay_us += delay_us;
+    if (delay_us > max_delay_us) max_delay_us = delay_us;
+    if (offset_ns < min_offset_ns) min_offset_ns = offset_ns;
+    if (offset_ns > max_offset_ns) max_offset_ns = offset_ns;
+
+    if (num_edges == PPS_STATS_EDGES) {
+      // the spread of the offset is mostly the jitter of the ISR latency
+      ESP_LOGI(TAG, "isr max=%d cycles, task delay mean=%dus max=%dus, edge offset %d..%dns, freq=%dppb",
+        pps_isr_max_cycles, (int32_t) (sum_delay_us / num_edges), (int32_t) max_delay_us, min_offset_ns, max_offset_ns, freq_ppb);
+
+      num_edges = 0;
+      pps_isr_max_cycles = 0;
+      sum_delay_us = 0;
+      max_delay_us = 0;
+      min_offset_ns = INT32_MAX;
+      max_offset_ns = INT32_MIN;
+    }
+  }
+}
+
 static void pps_init(void) {
+  esp_timer_create_args_t timer_args;
+  memset(&timer_args, 0, sizeof(esp_timer_create_args_t));
+  timer_args.callback = pps_wake_callback;
+  timer_args.name = "pps_wake";
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &pps_wake_timer));
+
+  xTaskCreate(pps_task, "pps_task", 2048, NULL, 6, &pps_task_handle);
+
   ESP_ERROR_CHECK(gpio_set_direction(GPIO_GPS_PPS, GPIO_MODE_INPUT));
   ESP_ERROR_CHECK(gpio_intr_enable(GPIO_GPS_PPS));
   ESP_ERROR_CHECK(gpio_set_intr_type(GPIO_GPS_PPS, GPIO_INTR_POSEDGE));
@@ -48,9 +217,99 @@ static void pps_init(void) {
   ESP_ERROR_CHECK(gpio_isr_handler_add(GPIO_GPS_PPS, pps_isr_handler, NULL));
 }
 
+static void set_next_time(uint64_t utc_ns) {
+  const char *TAG = "time-sync";
+
+  portENTER_CRITICAL(&next_time_mux);
+  next_utc_ns = utc_ns;
+  next_time_arrival = esp_timer_get_time();
+  portEXIT_CRITICAL(&next_time_mux);
+
+  int32_t offset_ns, freq_ppb;
+  clock_get_stats(&offset_ns, &freq_ppb);
+  ESP_LOGD(TAG, "pps offset=%dns freq=%dppb", offset_ns, freq_ppb);
+}
+
+#ifdef CONFIG_GPS_UBX_TIME
+  // GPS time counts from 1980-01-06 00:00:00 UTC
+  static const int64_t GPS_EPOCH = 315964800;
+  static const int64_t SECONDS_PER_WEEK = 604800;
+
+  // CFG-MSG: output NAV-TIMEUTC and TIM-TP on this port every navigation solution
+  static constexpr uint8_t UBX_CFG_MSG_TIMEUTC[] = {0xB5, 0x62, 0x06, 0x01, 0x03, 0x00, UBX_CLASS_NAV, UBX_ID_NAV_TIMEUTC, 0x01, 0x2D, 0x85};
+  static constexpr uint8_t UBX_CFG_MSG_TIM_TP[] = {0xB5, 0x62, 0x06, 0x01, 0x03, 0x00, UBX_CLASS_TIM, UBX_ID_TIM_TP, 0x01, 0x19, 0x69};
+
+  static_assert(ubx_frame_valid(UBX_CFG_MSG_TIMEUTC, sizeof(UBX_CFG_MSG_TIMEUTC)), "bad checksum in UBX_CFG_MSG_TIMEUTC");
+  static_assert(ubx_frame_valid(UBX_CFG_MSG_TIM_TP, sizeof(UBX_CFG_MSG_TIM_TP)), "bad checksum in UBX_CFG_MSG_TIM_TP");
+
+  // GPS time - UTC (s), from NAV-TIMEUTC. needed when the time pulse is aligned to GPS time
+  static bool has_leap_seconds = false;
+  static int32_t leap_seconds;
+
+  static void handle_nav_timeutc(const ubx_nav_timeutc_t *timeutc) {
+    if (!(timeutc->valid & UBX_TIMEUTC_VALID_UTC)) return;
+
+    struct tm _tm;
+    memset(&_tm, 0, sizeof(tm));
+
+    _tm.tm_year = timeutc->year - 1900;
+    _tm.tm_mon = timeutc->month - 1;
+    _tm.tm_mday = timeutc->day;
+    _tm.tm_hour = timeutc->hour;
+    _tm.tm_min = timeutc->min;
+    _tm.tm_sec = timeutc->sec;
+
+    // the epoch in UTC and in GPS time of week, both in ms
+    int64_t utc_ms = ((int64_t) mktime(&_tm) - GPS_EPOCH) % SECONDS_PER_WEEK * 1000 + timeutc->nano / 1000000;
+    int64_t diff_ms = ((int64_t) timeutc->i_tow - utc_ms) % (SECONDS_PER_WEEK * 1000);
+
+    // either may have just wrapped to the next week
+    if (diff_ms > SECONDS_PER_WEEK * 500) diff_ms -= SECONDS_PER_WEEK * 1000;
+    if (diff_ms < -SECONDS_PER_WEEK * 500) diff_ms += SECONDS_PER_WEEK * 1000;
+
+    leap_seconds = (diff_ms + (diff_ms >= 0 ? 500 : -500)) / 1000;
+    has_leap_seconds = true;
+  }
+
+  static void handle_tim_tp(const ubx_tim_tp_t *tp) {
+    if (!(tp->flags & UBX_TIM_TP_UTC) && !has_leap_seconds) return;
+
+    int64_t pulse_ms = (GPS_EPOCH + (int64_t) tp->week * SECONDS_PER_WEEK) * 1000 + tp->tow_ms;
+    if (!(tp->flags & UBX_TIM_TP_UTC)) pulse_ms -= (int64_t) leap_seconds * 1000;
+
+    // tow_sub_ms is in 2^-32 ms, q_err in ps. the pulse is output q_err early
+    uint64_t utc_ns = pulse_ms * 1000000 + (((uint64_t) tp->tow_sub_ms * 1000000) >> 32) - tp->q_err / 1000;
+
+    set_next_time(utc_ns);
+  }
+
+  static void handle_ubx(const ubx_parser_t *parser) {
+    ubx_tim_tp_t tp;
+    ubx_nav_timeutc_t timeutc;
+
+    if (ubx_get_tim_tp(parser, &tp)) {
+      handle_tim_tp(&tp);
+    } else if (ubx_get_nav_timeutc(parser, &timeutc)) {
+      handle_nav_timeutc(&timeutc);
+    }
+  }
+#endif
+
+bool gps_get_position(nmea_sentence_t *out) {
+  portENTER_CRITICAL(&position_mux);
+  *out = position;
+  portEXIT_CRITICAL(&position_mux);
+
+  return out->has_position;
+}
+
 void time_sync_task(void *pvParameter) {
   const char *TAG = "time-sync";
 
+  gps_lock_mutex = xSemaphoreCreateMutex();
+  // held until the first pps edge
+  gps_wake();
+
   pps_init();
 
   uart_config_t uart_config;
@@ -61,87 +320,121 @@ void time_sync_task(void *pvParameter) {
   uart_config.parity = UART_PARITY_DISABLE;
   uart_config.stop_bits = UART_STOP_BITS_1;
   uart_config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
-  uart_config.source_clk = UART_SCLK_APB;
+  // REF_TICK keeps the baud rate while the APB clock is scaled down
+  uart_config.source_clk = UART_SCLK_REF_TICK;
 
   uart_driver_install(UART_NUM, LEN_BUF_RX, LEN_BUF_TX, QUEUE_LEN, &uart_queue, 0);
   uart_param_config(UART_NUM, &uart_config);
   uart_set_pin(UART_NUM, GPIO_UART1_TXD, GPIO_UART1_RXD, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
 
-  uart_enable_pattern_det_baud_intr(UART_NUM, '\r', 1, 9, 0, 0);
-  uart_pattern_queue_reset(UART_NUM, QUEUE_LEN);
+  #ifdef CONFIG_NODE_POWER_SAVE
+    // a burst that starts while the chip light sleeps wakes it. the characters that wake it
+    // are lost, which only happens when no edge was expected before the burst
+    uart_set_wakeup_threshold(UART_NUM, 3);
+    esp_sleep_enable_uart_wakeup(UART_NUM);
+  #endif
 
-  // disable all messages
+  // disable all messages except GGA, which is kept for the position
   uart_write_bytes(UART_NUM, "$PUBX,40,GSA,0,0,0,0,0,0*4E\r\n", 29);
   uart_write_bytes(UART_NUM, "$PUBX,40,VTG,0,0,0,0,0,0*5E\r\n", 29);
   uart_write_bytes(UART_NUM, "$PUBX,40,RMC,0,0,0,0,0,0*47\r\n", 29);
   uart_write_bytes(UART_NUM, "$PUBX,40,GSV,0,0,0,0,0,0*59\r\n", 29);
   uart_write_bytes(UART_NUM, "$PUBX,40,GLL,0,0,0,0,0,0*5C\r\n", 29);
 
-  // enable ZDA (date time)
-  uart_write_bytes(UART_NUM, "$PUBX,40,ZDA,0,1,0,0,0,0*45\r\n", 29);
+  #ifdef CONFIG_GPS_UBX_TIME
+    // the time comes from TIM-TP and NAV-TIMEUTC instead of ZDA
+    uart_write_bytes(UART_NUM, "$PUBX,40,ZDA,0,0,0,0,0,0*44\r\n", 29);
+    uart_write_bytes(UART_NUM, (const char *) UBX_CFG_MSG_TIMEUTC, sizeof(UBX_CFG_MSG_TIMEUTC));
+    uart_write_bytes(UART_NUM, (const char *) UBX_CFG_MSG_TIM_TP, sizeof(UBX_CFG_MSG_TIM_TP));
+  #else
+    // enable ZDA (date time)
+    uart_write_bytes(UART_NUM, "$PUBX,40,ZDA,0,1,0,0,0,0*45\r\n", 29);
+  #endif
 
-  // configure module to tx at 115200 baud
+  // configure module to tx at 115200 baud, with UBX and NMEA output
   uart_write_bytes(UART_NUM, "$PUBX,41,1,0007,0003,115200,0*18\r\n", 36);
   uart_wait_tx_done(UART_NUM, portMAX_DELAY);
   uart_set_baudrate(UART_NUM, 115200);
 
   uart_event_t evt;
-  char buf_read[LEN_BUF_READ];
-  int br = -1;
+  uint8_t buf_read[LEN_BUF_READ];
+
+  nmea_parser_t parser;
+  nmea_init(&parser);
+  #ifdef CONFIG_GPS_UBX_TIME
+    ubx_parser_t ubx_parser;
+    ubx_init(&ubx_parser);
+  #endif
+  bool has_position = false;
 
   while(1) {
-    if(xQueueReceive(uart_queue, (void * )&evt, (portTickType)portMAX_DELAY)) {
+    // while the lock is held, wait for the end of the burst to release it
+    TickType_t wait = gps_lock_held ? pdMS_TO_TICKS(GPS_IDLE_MS) : portMAX_DELAY;
+
+    if (!xQueueReceive(uart_queue, (void * )&evt, wait)) {
+      gps_try_sleep();
+    } else {
       switch(evt.type) {
-        case UART_PATTERN_DET:
+        case UART_DATA:
         {
-          uint32_t time;
-          int day;
-          int month;
-          int year;
+          gps_wake();
 
-          memset(buf_read, 0, LEN_BUF_READ);
+          // an event can report more than one read's worth, and what is left behind would
+          // only be read at the next event
+          size_t len = 0;
+          uart_get_buffered_data_len(UART_NUM, &len);
 
-          uint8_t len = uart_pattern_pop_pos(UART_NUM) + 1;
-
-          if (len > LEN_BUF_READ) {
-            ESP_LOGW(TAG, "too long uart message of len=%d", len);
-            uart_flush(UART_NUM);
-            break;
-          }
+          while (len > 0) {
+            int br = uart_read_bytes(UART_NUM, buf_read, len < LEN_BUF_READ ? len : LEN_BUF_READ, 0);
+            if (br <= 0) {
+              if (br < 0) ESP_LOGW(TAG, "error reading bytes");
+              break;
+            }
+            len -= br;
 
-          // read up to the pattern
-          br = uart_read_bytes(UART_NUM, (uint8_t *) buf_read, len, 0);
+            for (int i = 0; i < br; i++) {
+              #ifdef CONFIG_GPS_UBX_TIME
+                if (ubx_feed(&ubx_parser, buf_read[i])) handle_ubx(&ubx_parser);
+              #endif
 
-          char * buf_print = buf_read;
-          // drop newline if exists
-          if (*buf_print == '\n') buf_print ++;
-          ESP_LOGD(TAG, "rx from gps: %s", buf_print);
+              nmea_sentence_t sentence;
+              if (!nmea_feed(&parser, buf_read[i], &sentence)) continue;
 
-          if (br > 0) {
-            // leading \n because UART splits on \r
-            if (sscanf(buf_read, "\n$GPZDA,%d.00,%d,%d,%d,00,00", &time, &day, &month, &year) == 4) {
-              struct tm _tm;
+              if (sentence.type == NMEA_ZDA && sentence.has_time && sentence.has_date) {
+                struct tm _tm;
 
-              memset(&_tm, 0, sizeof(tm));
+                memset(&_tm, 0, sizeof(tm));
 
-              _tm.tm_year = year - 1900;
-              _tm.tm_mon = month - 1;
-              _tm.tm_mday = day;
-              _tm.tm_hour = time / 10000;
-              _tm.tm_min = (time / 100) % 100;
-              // + 1 because the next pps edge is the next second
-              _tm.tm_sec = (time % 100) + 1;
+                uint32_t time = sentence.time_ms / 1000;
+                _tm.tm_year = sentence.year - 1900;
+                _tm.tm_mon = sentence.month - 1;
+                _tm.tm_mday = sentence.day;
+                _tm.tm_hour = time / 3600;
+                _tm.tm_min = (time / 60) % 60;
+                // + 1 because the next pps edge is the next second
+                _tm.tm_sec = (time % 60) + 1;
 
-              time_t t = mktime(&_tm);
-              next_time.tv_sec = t;
+                set_next_time((uint64_t) mktime(&_tm) * 1000000000);
+              } else if (sentence.type == NMEA_GGA && sentence.fix_valid && sentence.has_position) {
+                if (!has_position) {
+                  ESP_LOGI(TAG, "position fix: lat=%d lon=%d (1e-7 deg), %d satellites", sentence.lat, sentence.lon, sentence.num_sats);
+                  has_position = true;
+                }
 
-              next_time_arrival = esp_timer_get_time();
+                portENTER_CRITICAL(&position_mux);
+                position = sentence;
+                portEXIT_CRITICAL(&position_mux);
+              }
             }
-          } else {
-            ESP_LOGW(TAG, "error reading bytes");
           }
           break;
         }
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+          ESP_LOGW(TAG, "uart overflow");
+          uart_flush_input(UART_NUM);
+          xQueueReset(uart_queue);
+          break;
         default:
           break;
       }
@@ -1,6 +1,11 @@
 #ifndef TIME_SYNC_TASK_H
 #define TIME_SYNC_TASK_H
 
+#include "nmea.h"
+
 void time_sync_task(void *pvParameter);
 
+// copies the latest GGA sentence with a valid fix to out, returns false if there has not been one
+bool gps_get_position(nmea_sentence_t *out);
+
 #endif
@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "ubx.h"
+
+enum {
+  STATE_SYNC1 = 0,
+  STATE_SYNC2,
+  STATE_CLASS,
+  STATE_ID,
+  STATE_LEN1,
+  STATE_LEN2,
+  STATE_PAYLOAD,
+  STATE_CK_A,
+  STATE_CK_B
+};
+
+static void checksum_add(ubx_parser_t *parser, uint8_t c) {
+  parser->ck_a += c;
+  parser->ck_b += parser->ck_a;
+}
+
+void ubx_init(ubx_parser_t *parser) {
+  memset(parser, 0, sizeof(ubx_parser_t));
+  parser->state = STATE_SYNC1;
+}
+
+bool ubx_feed(ubx_parser_t *parser, uint8_t c) {
+  switch (parser->state) {
+    case STATE_SYNC1:
+      if (c == 0xB5) parser->state = STATE_SYNC2;
+      return false;
+
+    case STATE_SYNC2:
+      if (c == 0x62) {
+        parser->state = STATE_CLASS;
+        parser->ck_a = 0;
+        parser->ck_b = 0;
+      } else {
+        parser->state = c == 0xB5 ? STATE_SYNC2 : STATE_SYNC1;
+      }
+      return false;
+
+    case STATE_CLASS:
+      parser->msg_class = c;
+      checksum_add(parser, c);
+      parser->state = STATE_ID;
+      return false;
+
+    case STATE_ID:
+      parser->msg_id = c;
+      checksum_add(parser, c);
+      parser->state = STATE_LEN1;
+      return false;
+
+    case STATE_LEN1:
+      parser->len = c;
+      checksum_add(parser, c);
+      parser->state = STATE_LEN2;
+      return false;
+
+    case STATE_LEN2:
+      parser->len |= c << 8;
+      if (parser->len > UBX_MAX_LEN) {
+        parser->state = STATE_SYNC1;
+        return false;
+      }
+
+      checksum_add(parser, c);
+      parser->pos = 0;
+      parser->state = parser->len > 0 ? STATE_PAYLOAD : STATE_CK_A;
+      return false;
+
+    case STATE_PAYLOAD:
+      if (parser->pos < UBX_MAX_PAYLOAD) parser->payload[parser->pos] = c;
+      checksum_add(parser, c);
+
+      parser->pos ++;
+      if (parser->pos == parser->len) parser->state = STATE_CK_A;
+      return false;
+
+    case STATE_CK_A:
+      parser->state = c == parser->ck_a ? STATE_CK_B : STATE_SYNC1;
+      return false;
+
+    case STATE_CK_B:
+      parser->state = STATE_SYNC1;
+      return c == parser->ck_b;
+  }
+
+  parser->state = STATE_SYNC1;
+  return false;
+}
+
+bool ubx_get_tim_tp(const ubx_parser_t *parser, ubx_tim_tp_t *out) {
+  if (parser->msg_class != UBX_CLASS_TIM || parser->msg_id != UBX_ID_TIM_TP || parser->len != sizeof(ubx_tim_tp_t)) return false;
+
+  memcpy(out, parser->payload, sizeof(ubx_tim_tp_t));
+  return true;
+}
+
+bool ubx_get_nav_timeutc(const ubx_parser_t *parser, ubx_nav_timeutc_t *out) {
+  if (parser->msg_class != UBX_CLASS_NAV || parser->msg_id != UBX_ID_NAV_TIMEUTC || parser->len != sizeof(ubx_nav_timeutc_t)) return false;
+
+  memcpy(out, parser->payload, sizeof(ubx_nav_timeutc_t));
+  return true;
+}
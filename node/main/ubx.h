@@ -0,0 +1,95 @@
+#ifndef UBX_H
+#define UBX_H
+
+#include <stdint.h>
+
+/*
+  u-blox UBX binary protocol
+
+  frames are 0xB5 0x62, class, id, 16 bit little endian payload length, the
+  payload and a two byte Fletcher checksum over everything after the sync
+  chars. ubx_feed takes bytes one at a time and can share a stream with NMEA
+*/
+
+static const uint8_t UBX_CLASS_NAV = 0x01;
+static const uint8_t UBX_CLASS_TIM = 0x0D;
+static const uint8_t UBX_ID_NAV_TIMEUTC = 0x21;
+static const uint8_t UBX_ID_TIM_TP = 0x01;
+
+// longer frames are checked but their payload is not kept
+static const uint16_t UBX_MAX_PAYLOAD = 32;
+// no message the receiver is configured for comes close to this. a longer length is taken
+// as a false sync on payload or NMEA bytes, so the parser does not swallow up to 64KB of them
+static const uint16_t UBX_MAX_LEN = 512;
+
+// Fletcher checksum of data as sent in a frame, CK_A in the low byte
+constexpr uint16_t ubx_checksum(const uint8_t *data, uint16_t len, uint8_t ck_a = 0, uint8_t ck_b = 0) {
+  return len == 0 ? (ck_b << 8 | ck_a) :
+    ubx_checksum(data + 1, len - 1, ck_a + data[0], ck_b + ck_a + data[0]);
+}
+
+// true if frame is one whole UBX frame with a correct checksum
+// used in static_asserts so that hand written frames are checked at compile time
+constexpr bool ubx_frame_valid(const uint8_t *frame, uint16_t len) {
+  return len >= 8 && frame[0] == 0xB5 && frame[1] == 0x62 &&
+    (frame[4] | frame[5] << 8) == len - 8 &&
+    ubx_checksum(frame + 2, len - 4) == (frame[len - 2] | frame[len - 1] << 8);
+}
+
+// timing of the next time pulse
+typedef struct __attribute__((__packed__)) {
+  // time of week of the pulse (ms), and the fraction of a ms (2^-32 ms)
+  uint32_t tow_ms;
+  uint32_t tow_sub_ms;
+  // quantisation error of the pulse (ps): the pulse is output this much before the time it marks
+  int32_t q_err;
+  uint16_t week;
+  // bit 0: time base is UTC, not GNSS time
+  uint8_t flags;
+  uint8_t ref_info;
+} ubx_tim_tp_t;
+
+static const uint8_t UBX_TIM_TP_UTC = 0x01;
+
+// UTC of the navigation epoch
+typedef struct __attribute__((__packed__)) {
+  // GPS time of week of the epoch (ms)
+  uint32_t i_tow;
+  // accuracy estimate (ns)
+  uint32_t t_acc;
+  // fraction of a second (ns), can be negative
+  int32_t nano;
+  uint16_t year;
+  uint8_t month;
+  uint8_t day;
+  uint8_t hour;
+  uint8_t min;
+  uint8_t sec;
+  // bit 2: UTC is valid
+  uint8_t valid;
+} ubx_nav_timeutc_t;
+
+static const uint8_t UBX_TIMEUTC_VALID_UTC = 0x04;
+
+typedef struct {
+  uint8_t state;
+  uint8_t msg_class;
+  uint8_t msg_id;
+  uint16_t len;
+  uint16_t pos;
+  uint8_t ck_a;
+  uint8_t ck_b;
+  uint8_t payload[UBX_MAX_PAYLOAD];
+} ubx_parser_t;
+
+void ubx_init(ubx_parser_t *parser);
+
+// feeds one byte, returns true if it completed a frame with a correct checksum,
+// whose class, id and payload are then in parser
+bool ubx_feed(ubx_parser_t *parser, uint8_t c);
+
+// copy the payload of the last frame to out if it is of that type
+bool ubx_get_tim_tp(const ubx_parser_t *parser, ubx_tim_tp_t *out);
+bool ubx_get_nav_timeutc(const ubx_parser_t *parser, ubx_nav_timeutc_t *out);
+
+#endif
@@ -0,0 +1,31 @@
+// the driver built for the compensation mode set on the command line. the Makefile builds
+// this once per mode and makes every symbol but the wrapper local, so both link into one test
+#include "bme280.c"
+
+#include "bme280_mode.h"
+
+#if defined(BME280_FLOAT_ENABLE)
+void bme280_compensate_float(const struct bme280_uncomp_data *uncomp_data, const struct bme280_calib_data *calib_data, bme280_result_t *out) {
+  // t_fine is written by the temperature compensation
+  struct bme280_calib_data calib = *calib_data;
+  struct bme280_data comp_data;
+  bme280_compensate_data(BME280_ALL, uncomp_data, &comp_data, &calib);
+
+  out->temperature = comp_data.temperature;
+  out->pressure = comp_data.pressure;
+  out->humidity = comp_data.humidity;
+}
+#elif defined(BME280_64BIT_ENABLE)
+void bme280_compensate_int64(const struct bme280_uncomp_data *uncomp_data, const struct bme280_calib_data *calib_data, bme280_result_t *out) {
+  struct bme280_calib_data calib = *calib_data;
+  struct bme280_data comp_data;
+  bme280_compensate_data(BME280_ALL, uncomp_data, &comp_data, &calib);
+
+  // the units stored in the records, see sensor.h
+  out->temperature = comp_data.temperature / 100.0;
+  out->pressure = comp_data.pressure / 100.0;
+  out->humidity = comp_data.humidity / 1024.0;
+}
+#else
+#error "build with BME280_FLOAT_ENABLE or BME280_64BIT_ENABLE"
+#endif
@@ -0,0 +1,28 @@
+#ifndef BME280_MODE_H
+#define BME280_MODE_H
+
+#include <stdint.h>
+
+#include "bme280_defs.h"
+
+// compensated values in degC, Pa and %RH, whatever the compensation mode
+typedef struct {
+  double temperature;
+  double pressure;
+  double humidity;
+} bme280_result_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bme280_compensate_data of the driver built with BME280_FLOAT_ENABLE and with
+// BME280_64BIT_ENABLE, see bme280_mode.c
+void bme280_compensate_float(const struct bme280_uncomp_data *uncomp_data, const struct bme280_calib_data *calib_data, bme280_result_t *out);
+void bme280_compensate_int64(const struct bme280_uncomp_data *uncomp_data, const struct bme280_calib_data *calib_data, bme280_result_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ESP_ERR_H
+#define ESP_ERR_H
+
+// host stand-ins for the ESP-IDF headers that common.h pulls in
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#endif
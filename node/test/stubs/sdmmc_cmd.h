@@ -0,0 +1,8 @@
+#ifndef SDMMC_CMD_H
+#define SDMMC_CMD_H
+
+typedef struct {
+  int unused;
+} sdmmc_card_t;
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bme280_mode.h"
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    num_failed ++; \
+  } \
+} while (0)
+
+// largest difference of the 64-bit integer compensation from the double one. the integer
+// outputs have a resolution of 0.01 degC, 0.01 Pa and 1/1024 %RH, and round differently
+// along the way
+static const double TOLERANCE_TEMPERATURE = 0.01;
+static const double TOLERANCE_PRESSURE = 1.0;
+static const double TOLERANCE_HUMIDITY = 0.01;
+
+// steps across each raw ADC range
+static const uint32_t NUM_STEPS = 64;
+
+// the example coefficients from the BME280 datasheet, and typical humidity coefficients
+static struct bme280_calib_data datasheet_calib(void) {
+  struct bme280_calib_data calib;
+  memset(&calib, 0, sizeof(calib));
+
+  calib.dig_t1 = 27504;
+  calib.dig_t2 = 26435;
+  calib.dig_t3 = -1000;
+  calib.dig_p1 = 36477;
+  calib.dig_p2 = -10685;
+  calib.dig_p3 = 3024;
+  calib.dig_p4 = 2855;
+  calib.dig_p5 = 140;
+  calib.dig_p6 = -7;
+  calib.dig_p7 = 15500;
+  calib.dig_p8 = -14600;
+  calib.dig_p9 = 6000;
+  calib.dig_h1 = 75;
+  calib.dig_h2 = 362;
+  calib.dig_h3 = 0;
+  calib.dig_h4 = 313;
+  calib.dig_h5 = 50;
+  calib.dig_h6 = 30;
+
+  return calib;
+}
+
+// the worked example in the datasheet: 25.08 degC and 100653.27 Pa
+static void test_datasheet_example(void) {
+  struct bme280_calib_data calib = datasheet_calib();
+  struct bme280_uncomp_data raw;
+  raw.temperature = 519888;
+  raw.pressure = 415148;
+  raw.humidity = 0;
+
+  bme280_result_t fp, in;
+
+  bme280_compensate_float(&raw, &calib, &fp);
+  bme280_compensate_int64(&raw, &calib, &in);
+
+  CHECK(fabs(fp.temperature - 25.08) < 0.01);
+  CHECK(fabs(in.temperature - 25.08) < 0.01);
+  CHECK(fabs(fp.pressure - 100653.27) < 1);
+  CHECK(fabs(in.pressure - 100653.27) < 1);
+}
+
+// the double results are clamped to the sensor's range. outside it the integer path does not
+// always clamp to the same end, a pressure below the range wraps around to the maximum
+static bool in_range(double value, double min, double max) {
+  return value > min && value < max;
+}
+
+static void test_grid(void) {
+  struct bme280_calib_data calib = datasheet_calib();
+  double max_t = 0, max_p = 0, max_h = 0;
+  uint32_t num_compared = 0;
+
+  for (uint32_t i = 0; i < NUM_STEPS; i++) {
+    for (uint32_t j = 0; j < NUM_STEPS; j++) {
+      for (uint32_t k = 0; k < NUM_STEPS; k++) {
+        struct bme280_uncomp_data raw;
+        raw.temperature = i * 0xFFFFF / (NUM_STEPS - 1);
+        raw.pressure = j * 0xFFFFF / (NUM_STEPS - 1);
+        raw.humidity = k * 0xFFFF / (NUM_STEPS - 1);
+
+        bme280_result_t fp, in;
+        bme280_compensate_float(&raw, &calib, &fp);
+        bme280_compensate_int64(&raw, &calib, &in);
+
+        // pressure and humidity are compensated for the temperature
+        if (!in_range(fp.temperature, -40, 85)) continue;
+
+        double dt = fabs(fp.temperature - in.temperature);
+        double dp = in_range(fp.pressure, 30000, 110000) ? fabs(fp.pressure - in.pressure) : 0;
+        double dh = in_range(fp.humidity, 0, 100) ? fabs(fp.humidity - in.humidity) : 0;
+
+        if (dt > max_t) max_t = dt;
+        if (dp > max_p) max_p = dp;
+        if (dh > max_h) max_h = dh;
+        num_compared ++;
+
+        if (dt > TOLERANCE_TEMPERATURE || dp > TOLERANCE_PRESSURE || dh > TOLERANCE_HUMIDITY) {
+          printf("raw %u %u %u: double %.4f %.4f %.4f, int64 %.4f %.4f %.4f\n",
+            raw.temperature, raw.pressure, raw.humidity, fp.temperature, fp.pressure, fp.humidity,
+            in.temperature, in.pressure, in.humidity);
+          num_failed ++;
+        }
+      }
+    }
+  }
+
+  printf("test_bme280: max difference %.4f degC, %.4f Pa, %.4f %%RH over %u points\n", max_t, max_p, max_h, num_compared);
+  CHECK(num_compared > 0);
+}
+
+int main(void) {
+  test_datasheet_example();
+  test_grid();
+
+  if (num_failed > 0) {
+    printf("test_bme280: %d checks failed\n", num_failed);
+    return 1;
+  }
+
+  printf("test_bme280: passed\n");
+  return 0;
+}
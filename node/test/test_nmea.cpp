@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nmea.h"
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    num_failed ++; \
+  } \
+} while (0)
+
+// feeds str, returns the number of sentences completed, the last one is copied to out
+static int feed(nmea_parser_t *parser, const char *str, nmea_sentence_t *out) {
+  int count = 0;
+  for (const char *c = str; *c; c++) {
+    if (nmea_feed(parser, *c, out)) count ++;
+  }
+  return count;
+}
+
+// wraps body in $ and *checksum\r\n
+static void make_sentence(const char *body, char *out) {
+  uint8_t checksum = 0;
+  for (const char *c = body; *c; c++) checksum ^= *c;
+  sprintf(out, "$%s*%02X\r\n", body, checksum);
+}
+
+static void test_known_sentences(void) {
+  nmea_parser_t parser;
+  nmea_sentence_t s;
+  nmea_init(&parser);
+
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n", &s) == 1);
+  CHECK(s.type == NMEA_GGA);
+  CHECK(s.has_time && s.time_ms == 45319000);
+  CHECK(s.has_position);
+  CHECK(abs(s.lat - 481173000) <= 1);
+  CHECK(abs(s.lon - 115166667) <= 1);
+  CHECK(s.fix_valid);
+  CHECK(s.num_sats == 8);
+  CHECK(s.has_altitude && s.altitude_mm == 545400);
+
+  CHECK(feed(&parser, "$GPRMC,123519,A,4807.038,S,01131.000,W,022.4,084.4,230394,003.1,W*6A\r\n", &s) == 0);
+
+  CHECK(feed(&parser, "$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*6A\r\n", &s) == 1);
+  CHECK(s.type == NMEA_RMC);
+  CHECK(s.has_time && s.time_ms == 45319000);
+  // two digit years are taken to be after 2000
+  CHECK(s.has_date && s.year == 2094 && s.month == 3 && s.day == 23);
+  CHECK(s.fix_valid);
+
+  char line[128];
+  make_sentence("GNRMC,083000.50,A,0117.500,N,10351.000,E,0.0,0.0,150624,,,A", line);
+  CHECK(feed(&parser, line, &s) == 1);
+  CHECK(s.time_ms == 30600500);
+  CHECK(s.has_date && s.year == 2024 && s.month == 6 && s.day == 15);
+  CHECK(abs(s.lat - 12916667) <= 1 && s.lon == 1038500000);
+
+  make_sentence("GNZDA,201530.25,04,07,2002,00,00", line);
+  CHECK(feed(&parser, line, &s) == 1);
+  CHECK(s.type == NMEA_ZDA);
+  CHECK(s.has_time && s.time_ms == 72930250);
+  CHECK(s.has_date && s.year == 2002 && s.month == 7 && s.day == 4);
+
+  // southern and western hemispheres, and a void RMC
+  make_sentence("GPRMC,000000,V,3351.000,S,15112.000,W,,,010120,,", line);
+  CHECK(feed(&parser, line, &s) == 1);
+  CHECK(s.has_position && s.lat == -338500000 && s.lon == -1512000000);
+  CHECK(!s.fix_valid);
+
+  // other sentences are skipped
+  make_sentence("GPGSV,1,1,00", line);
+  CHECK(feed(&parser, line, &s) == 0);
+}
+
+static void test_bad_checksum(void) {
+  nmea_parser_t parser;
+  nmea_sentence_t s;
+  nmea_init(&parser);
+
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*48\r\n", &s) == 0);
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*4\r\n", &s) == 0);
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*XY\r\n", &s) == 0);
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,\r\n", &s) == 0);
+
+  // the parser recovers for the next sentence
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n", &s) == 1);
+}
+
+static void test_overlong_and_truncated(void) {
+  nmea_parser_t parser;
+  nmea_sentence_t s;
+  nmea_init(&parser);
+  char body[256], line[300];
+
+  // a sentence over 82 characters is dropped, even with a correct checksum
+  strcpy(body, "GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,");
+  while (strlen(body) < 100) strcat(body, "0");
+  make_sentence(body, line);
+  CHECK(feed(&parser, line, &s) == 0);
+
+  // a line with no end does not break the parser
+  memset(line, 'A', sizeof(line) - 1);
+  line[0] = '$';
+  line[sizeof(line) - 1] = '\0';
+  CHECK(feed(&parser, line, &s) == 0);
+
+  // a sentence cut off by the start of the next one is dropped, the next one is kept
+  CHECK(feed(&parser, "$GPGGA,123519,4807.0", &s) == 0);
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n", &s) == 1);
+  CHECK(s.type == NMEA_GGA && s.num_sats == 8);
+
+  // cut off inside the checksum
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*4", &s) == 0);
+  CHECK(feed(&parser, "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n", &s) == 1);
+}
+
+static void test_random_bytes(void) {
+  nmea_parser_t parser;
+  nmea_sentence_t s;
+  nmea_init(&parser);
+  srand(1);
+
+  // random bytes, biased towards the characters the parser acts on
+  const char special[] = "$*,.\r\nGPZDARMCGA0123456789NSEW-";
+  for (int i = 0; i < 1000000; i++) {
+    uint8_t c = (rand() % 4 == 0) ? special[rand() % (sizeof(special) - 1)] : rand();
+    if (nmea_feed(&parser, c, &s)) {
+      CHECK(s.type == NMEA_ZDA || s.type == NMEA_RMC || s.type == NMEA_GGA);
+    }
+  }
+
+  // and it still parses a valid sentence afterwards
+  CHECK(feed(&parser, "\r\n$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n", &s) == 1);
+}
+
+int main(void) {
+  test_known_sentences();
+  test_bad_checksum();
+  test_overlong_and_truncated();
+  test_random_bytes();
+
+  if (num_failed > 0) {
+    printf("test_nmea: %d checks failed\n", num_failed);
+    return 1;
+  }
+
+  printf("test_nmea: passed\n");
+  return 0;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+// paths.cpp is built on its own, without common.cpp. the card is a directory under the
+// test's working directory, short enough that the longest paths still fit LEN_MAX_FNAME
+const char *SD_MOUNT_POINT = "sdcard";
+
+static int num_failed = 0;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    num_failed ++; \
+  } \
+} while (0)
+
+static uint8_t ADDR[6] = {0x24, 0x0a, 0xc4, 0x12, 0x34, 0x56};
+
+static bool is_dir(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool create_file(const char *path, uint32_t size) {
+  if (!make_parent_dirs(path)) return false;
+
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) return false;
+
+  for (uint32_t i = 0; i < size; i++) fputc(i, fp);
+  fclose(fp);
+  return true;
+}
+
+static void test_conv_strtoul(void) {
+  uint16_t num = 1234;
+
+  CHECK(conv_strtoul((char *) "0", &num) && num == 0);
+  CHECK(conv_strtoul((char *) "42", &num) && num == 42);
+  CHECK(conv_strtoul((char *) "00042", &num) && num == 42);
+  CHECK(conv_strtoul((char *) "65535", &num) && num == 65535);
+  CHECK(conv_strtoul((char *) "7", NULL));
+
+  // out of range for an index
+  num = 1234;
+  CHECK(!conv_strtoul((char *) "65536", &num));
+  CHECK(!conv_strtoul((char *) "99999999999999999999999", &num));
+
+  // anything that is not only digits, which strtoul alone would accept
+  CHECK(!conv_strtoul((char *) "", &num));
+  CHECK(!conv_strtoul((char *) "12a", &num));
+  CHECK(!conv_strtoul((char *) " 12", &num));
+  CHECK(!conv_strtoul((char *) "+12", &num));
+  CHECK(!conv_strtoul((char *) "-1", &num));
+  CHECK(!conv_strtoul((char *) "0x10", &num));
+  CHECK(!conv_strtoul((char *) "B01", &num));
+  CHECK(!conv_strtoul((char *) "12.tmp", &num));
+  CHECK(num == 1234);
+}
+
+static void test_index_paths(void) {
+  char path[LEN_MAX_FNAME];
+
+  get_index_path(0, path);
+  CHECK(strcmp(path, "sdcard/B00/0") == 0);
+  get_index_path(FILES_PER_BUCKET - 1, path);
+  CHECK(strcmp(path, "sdcard/B00/255") == 0);
+  get_index_path(FILES_PER_BUCKET, path);
+  CHECK(strcmp(path, "sdcard/B01/256") == 0);
+  get_index_path(0xABCD, path);
+  CHECK(strcmp(path, "sdcard/BAB/43981") == 0);
+  get_index_path(65535, path);
+  CHECK(strcmp(path, "sdcard/BFF/65535") == 0);
+
+  get_addr_id_path(ADDR, 300, path);
+  CHECK(strcmp(path, "sdcard/240AC4123456/B01/300") == 0);
+
+  // the longest path on the card itself has to fit
+  const char *mount_point = SD_MOUNT_POINT;
+  SD_MOUNT_POINT = "/sdcard";
+  get_addr_id_path(ADDR, 65535, path);
+  CHECK(strcmp(path, "/sdcard/240AC4123456/BFF/65535") == 0);
+  SD_MOUNT_POINT = mount_point;
+}
+
+static void test_card_layout(void) {
+  char path[LEN_MAX_FNAME];
+
+  CHECK(mkdir(SD_MOUNT_POINT, 0777) == 0);
+
+  // collector layout
+  get_addr_id_path(ADDR, 300, path);
+  CHECK(make_parent_dirs(path));
+  CHECK(is_dir("sdcard/240AC4123456"));
+  CHECK(is_dir("sdcard/240AC4123456/B01"));
+  CHECK(!is_dir(path));
+  // the directories already exist the second time
+  CHECK(make_parent_dirs(path));
+
+  CHECK(create_file(path, 100));
+  uint32_t size = 0;
+  CHECK(get_file_size(ADDR, 300, &size) && size == 100);
+  CHECK(!get_file_size(ADDR, 301, &size));
+
+  // node layout, with names in the buckets that are not files
+  get_index_path(5, path);
+  CHECK(create_file(path, 10));
+  get_index_path(300, path);
+  CHECK(create_file(path, 20));
+  get_index_path(0, path);
+  CHECK(create_file(path, 1));
+  CHECK(create_file("sdcard/B00/5.tmp", 1));
+  CHECK(create_file("sdcard/B00/70000", 1));
+  CHECK(mkdir("sdcard/B00/7", 0777) == 0);
+  CHECK(create_file("sdcard/Backup/9", 1));
+
+  CHECK(get_file_size(300, &size) && size == 20);
+
+  uint16_t indices[8];
+  uint16_t count = list_index_files(indices, 8);
+  CHECK(count == 2);
+  CHECK((indices[0] == 5 && indices[1] == 300) || (indices[0] == 300 && indices[1] == 5));
+  CHECK(list_index_files(NULL, 8) == 2);
+  CHECK(list_index_files(indices, 1) == 1);
+
+  const char *files[] = {
+    "sdcard/240AC4123456/B01/300", "sdcard/B00/5", "sdcard/B01/300", "sdcard/B00/0",
+    "sdcard/B00/5.tmp", "sdcard/B00/70000", "sdcard/Backup/9"
+  };
+  for (const char *file : files) unlink(file);
+
+  const char *dirs[] = {"sdcard/240AC4123456/B01", "sdcard/240AC4123456", "sdcard/B00/7", "sdcard/B00", "sdcard/B01", "sdcard/Backup", "sdcard"};
+  for (const char *dir : dirs) CHECK(rmdir(dir) == 0);
+}
+
+int main(void) {
+  test_conv_strtoul();
+  test_index_paths();
+  test_card_layout();
+
+  if (num_failed > 0) {
+    printf("test_paths: %d checks failed\n", num_failed);
+    return 1;
+  }
+
+  printf("test_paths: passed\n");
+  return 0;
+}
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+simulates how long a collector flying past takes to find a node using
+CONFIG_RENDEZVOUS, and what the node radio costs
+
+the node radio is on for the first WINDOW seconds of every PERIOD seconds.
+the collector arrives at a random time, stays in range for a given time and
+broadcasts a SYNC every SYNC_INTERVAL seconds at a random phase. the node is
+found at the first SYNC sent while its radio is on and the collector is in range
+
+    ./rendezvous_sim.py --period 30 --window 3 --in-range 60
+    ./rendezvous_sim.py --sweep
+"""
+
+import argparse
+import random
+import statistics
+
+# collector SYNC broadcast interval (s), see collector/main/mtftp_task.cpp
+SYNC_INTERVAL = 1.5
+
+
+def discovery_time(period, window, in_range, sync_interval, rng):
+    """seconds from the collector arriving until it finds the node, or None if it leaves first"""
+    arrival = rng.uniform(0, period)
+    t = arrival + rng.uniform(0, sync_interval)
+
+    while t < arrival + in_range:
+        if t % period < window:
+            return t - arrival
+        t += sync_interval
+
+    return None
+
+
+def simulate(period, window, in_range, sync_interval, runs, rng):
+    times = []
+    misses = 0
+
+    for _ in range(runs):
+        t = discovery_time(period, window, in_range, sync_interval, rng)
+        if t is None:
+            misses += 1
+        else:
+            times.append(t)
+
+    times.sort()
+    return {
+        "mean": statistics.mean(times) if times else float("nan"),
+        "p95": times[int(len(times) * 0.95)] if times else float("nan"),
+        "miss": misses / runs,
+    }
+
+
+def radio_energy(period, window, radio_ma, sleep_ma, voltage):
+    """average current (mA) and energy per day (J) of the radio duty cycle"""
+    duty = window / period
+    current = duty * radio_ma + (1 - duty) * sleep_ma
+    return duty, current, current / 1000 * voltage * 86400
+
+
+def print_row(period, window, args, rng):
+    result = simulate(period, window, args.in_range, args.sync_interval, args.runs, rng)
+    duty, current, energy = radio_energy(period, window, args.radio_ma, args.sleep_ma, args.voltage)
+    print("%6d %6d %6.1f%% %8.1f %8.1f %7.1f%% %8.1f %9.0f" % (
+        period, window, duty * 100, result["mean"], result["p95"], result["miss"] * 100, current, energy))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--period", type=int, default=30, help="RENDEZVOUS_PERIOD (s)")
+    parser.add_argument("--window", type=int, default=3, help="RENDEZVOUS_WINDOW (s)")
+    parser.add_argument("--in-range", type=float, default=60, help="time the collector stays in range (s)")
+    parser.add_argument("--sync-interval", type=float, default=SYNC_INTERVAL, help="collector SYNC interval (s)")
+    parser.add_argument("--radio-ma", type=float, default=100, help="node current with the radio listening (mA)")
+    parser.add_argument("--sleep-ma", type=float, default=3, help="node current with the radio stopped (mA)")
+    parser.add_argument("--voltage", type=float, default=3.3)
+    parser.add_argument("--runs", type=int, default=100000)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--sweep", action="store_true", help="compare a range of periods and windows")
+    args = parser.parse_args()
+
+    if args.window >= args.period:
+        parser.error("window must be shorter than period")
+
+    rng = random.Random(args.seed)
+
+    print("in range for %.0fs, SYNC every %.1fs, %d runs" % (args.in_range, args.sync_interval, args.runs))
+    print("%6s %6s %7s %8s %8s %8s %8s %9s" % ("period", "window", "duty", "mean(s)", "p95(s)", "missed", "mA", "J/day"))
+
+    if args.sweep:
+        for period in (10, 30, 60, 120):
+            for window in (2, 3, 5):
+                if window < period:
+                    print_row(period, window, args, rng)
+    else:
+        print_row(args.period, args.window, args, rng)
+
+
+if __name__ == "__main__":
+    main()